@@ -0,0 +1,79 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Chunk-decode throughput: decodes every block on the chain of each file
+ * repeatedly, with no handlers, and reports payload bytes and chunks per
+ * second.
+ *
+ *     make bench_decode && ./bench_decode test/data/fmp12/Charts.fmp12
+ */
+
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../fmp.h"
+#include "../fmp_internal.h"
+
+#define MIN_SECONDS 1.0
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    fmp_open_options_t options = { .io_mode = FMP_IO_READ };
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [file] ...\n", argv[0]);
+        return 1;
+    }
+    for (int i=1; i<argc; i++) {
+        fmp_error_t error = FMP_OK;
+        fmp_file_t *file = fmp_open_file_with_options(argv[i], &options, &error);
+        if (!file) {
+            fprintf(stderr, "%s: error code %d\n", argv[i], error);
+            continue;
+        }
+        size_t bytes = 0, chunks = 0, passes = 0;
+        double start = now(), elapsed = 0.0;
+        do {
+            size_t steps = 0;
+            for (size_t next = 2; next && next-1 < file->num_blocks && steps < file->num_blocks; steps++) {
+                fmp_block_t *block = file->blocks[next-1];
+                fmp_chunk_list_t *list = NULL;
+                if (process_block(file, block, &list) != FMP_OK)
+                    break;
+                bytes += block->payload_len;
+                chunks += list->count;
+                next = block->next_id;
+            }
+            passes++;
+        } while ((elapsed = now() - start) < MIN_SECONDS);
+        printf("%s: %zu passes, %.1f MB/s, %.1f M chunks/s\n", argv[i], passes,
+                bytes / elapsed / 1e6, chunks / elapsed / 1e6);
+        fmp_close_file(file);
+    }
+    return 0;
+}
@@ -28,9 +28,31 @@
 #include "../fmp.h"
 #include "usage.h"
 
-fmp_handler_status_t handle_value(int row, fmp_column_t *column, const char *value, void *ctxp) {
-    lxw_worksheet *ws = (lxw_worksheet *)ctxp;
-    worksheet_write_string(ws, row, column->index-1, value, NULL);
+typedef struct fmp_excel_ctx_s {
+    lxw_workbook *wb;
+    lxw_worksheet *ws;
+} fmp_excel_ctx_t;
+
+fmp_handler_status_t handle_table(fmp_table_t *table, fmp_column_array_t *columns, void *ctxp) {
+    fmp_excel_ctx_t *ctx = (fmp_excel_ctx_t *)ctxp;
+    lxw_worksheet *ws = workbook_add_worksheet(ctx->wb, table->utf8_name);
+    if (!ws) {
+        fprintf(stderr, "Error adding workbook named %s\n", table->utf8_name);
+        return FMP_HANDLER_ABORT;
+    }
+    worksheet_freeze_panes(ws, 1, 0);
+    for (int j=0; j<columns->count; j++) {
+        fmp_column_t *column = &columns->columns[j];
+        worksheet_write_string(ws, 0, column->index-1, column->utf8_name, NULL);
+    }
+    ctx->ws = ws;
+    return FMP_HANDLER_OK;
+}
+
+fmp_handler_status_t handle_value(fmp_table_t *table, int row, fmp_column_t *column,
+        const char *value, void *ctxp) {
+    fmp_excel_ctx_t *ctx = (fmp_excel_ctx_t *)ctxp;
+    worksheet_write_string(ctx->ws, row, column->index-1, value, NULL);
     return FMP_HANDLER_OK;
 }
 
@@ -45,7 +67,7 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error opening workbook at %s\n", argv[2]);
         return 1;
     }
-    fmp_file_t *file = fmp_open_file(argv[1], &error);
+    fmp_file_t *file = open_input_file(argv[1], &error);
     if (!file) {
         fprintf(stderr, "Error code: %d\n", error);
         return 1;
@@ -55,28 +77,11 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error code: %d\n", error);
         return 1;
     }
-    for (int i=0; i<tables->count; i++) {
-        fmp_table_t *table = &tables->tables[i];
-        lxw_worksheet *ws = workbook_add_worksheet(wb, table->utf8_name);
-        if (!ws) {
-            fprintf(stderr, "Error adding workbook named %s\n", table->utf8_name);
-            return 1;
-        }
-        worksheet_freeze_panes(ws, 1, 0);
-        fmp_column_array_t *columns = fmp_list_columns(file, table, &error);
-        if (!columns) {
-            fprintf(stderr, "Error code: %d\n", error);
-            return 1;
-        }
-        for (int j=0; j<columns->count; j++) {
-            fmp_column_t *column = &columns->columns[j];
-            worksheet_write_string(ws, 0, column->index-1, column->utf8_name, NULL);
-        }
-        error = fmp_read_values(file, table, &handle_value, ws);
-        if (error != FMP_OK) {
-            fprintf(stderr, "Error code: %d\n", error);
-            return 1;
-        }
+    fmp_excel_ctx_t ctx = { .wb = wb };
+    error = fmp_read_all_values(file, tables, &handle_table, &handle_value, &ctx);
+    if (error != FMP_OK) {
+        fprintf(stderr, "Error code: %d\n", error);
+        return 1;
     }
     workbook_close(wb);
     fmp_free_tables(tables);
@@ -31,6 +31,7 @@
 typedef struct my_ctx_s {
     yajl_gen g;
     int last_row;
+    int in_table;
 } my_ctx_t;
 
 const char types[][10] = {
@@ -73,7 +74,54 @@ const char collations[][3] = {
     [FMP_COLLATION_SPANISH_ALT] = "es",
 };
 
-fmp_handler_status_t handle_value(int row, fmp_column_t *column, const char *value, void *ws) {
+static void close_table(my_ctx_t *ctx) {
+    if (!ctx->in_table)
+        return;
+    if (ctx->last_row)
+        yajl_gen_map_close(ctx->g);
+    yajl_gen_array_close(ctx->g);
+    yajl_gen_map_close(ctx->g);
+    ctx->in_table = 0;
+}
+
+fmp_handler_status_t handle_table(fmp_table_t *table, fmp_column_array_t *columns, void *ws) {
+    my_ctx_t *ctx = (my_ctx_t *)ws;
+    yajl_gen g = ctx->g;
+    close_table(ctx);
+    yajl_gen_map_open(g);
+    yajl_gen_string(g, (const unsigned char *)"name", sizeof("name")-1);
+    yajl_gen_string(g, (const unsigned char *)table->utf8_name, strlen(table->utf8_name));
+    yajl_gen_string(g, (const unsigned char *)"columns", sizeof("columns")-1);
+    yajl_gen_array_open(g);
+    for (int k=0; k<columns->count; k++) {
+        fmp_column_t *column = &columns->columns[k];
+        yajl_gen_map_open(g);
+        yajl_gen_string(g, (const unsigned char *)"name", sizeof("name")-1);
+        yajl_gen_string(g, (const unsigned char *)column->utf8_name, strlen(column->utf8_name));
+        if (column->type
+                && column->type < sizeof(types)/sizeof(types[0]) 
+                && types[column->type][0]) {
+            yajl_gen_string(g, (const unsigned char *)"type", sizeof("type")-1);
+            yajl_gen_string(g, (const unsigned char *)types[column->type], strlen(types[column->type]));
+        }
+        if (column->collation
+                && column->collation < sizeof(collations)/sizeof(collations[0])
+                && collations[column->collation][0]) {
+            yajl_gen_string(g, (const unsigned char *)"collation", sizeof("collation")-1);
+            yajl_gen_string(g, (const unsigned char *)collations[column->collation], 2);
+        }
+        yajl_gen_map_close(g);
+    }
+    yajl_gen_array_close(g);
+    yajl_gen_string(g, (const unsigned char *)"values", sizeof("values")-1);
+    yajl_gen_array_open(g);
+    ctx->last_row = 0;
+    ctx->in_table = 1;
+    return FMP_HANDLER_OK;
+}
+
+fmp_handler_status_t handle_value(fmp_table_t *table, int row, fmp_column_t *column,
+        const char *value, void *ws) {
     my_ctx_t *ctx = (my_ctx_t *)ws;
     if (row != ctx->last_row) {
         if (ctx->last_row)
@@ -95,7 +143,7 @@ int main(int argc, char *argv[]) {
     yajl_gen g = yajl_gen_alloc(NULL);
     my_ctx_t ctx = { .g = g };
 
-    fmp_file_t *file = fmp_open_file(argv[1], &error);
+    fmp_file_t *file = open_input_file(argv[1], &error);
     if (!file) {
         fprintf(stderr, "Error code: %d\n", error);
         return 1;
@@ -110,50 +158,12 @@ int main(int argc, char *argv[]) {
     yajl_gen_config(ctx.g, yajl_gen_beautify, 1);
 
     yajl_gen_array_open(g);
-    for (int j=0; j<tables->count; j++) {
-        fmp_table_t *table = &tables->tables[j];
-        yajl_gen_map_open(g);
-        yajl_gen_string(g, (const unsigned char *)"name", sizeof("name")-1);
-        yajl_gen_string(g, (const unsigned char *)table->utf8_name, strlen(table->utf8_name));
-        yajl_gen_string(g, (const unsigned char *)"columns", sizeof("columns")-1);
-        yajl_gen_array_open(g);
-        fmp_column_array_t *columns = fmp_list_columns(file, table, &error);
-        for (int k=0; k<columns->count; k++) {
-            fmp_column_t *column = &columns->columns[k];
-            yajl_gen_map_open(g);
-            yajl_gen_string(g, (const unsigned char *)"name", sizeof("name")-1);
-            yajl_gen_string(g, (const unsigned char *)column->utf8_name, strlen(column->utf8_name));
-            if (column->type
-                    && column->type < sizeof(types)/sizeof(types[0]) 
-                    && types[column->type][0]) {
-                yajl_gen_string(g, (const unsigned char *)"type", sizeof("type")-1);
-                yajl_gen_string(g, (const unsigned char *)types[column->type], strlen(types[column->type]));
-            }
-            if (column->collation
-                    && column->collation < sizeof(collations)/sizeof(collations[0])
-                    && collations[column->collation][0]) {
-                yajl_gen_string(g, (const unsigned char *)"collation", sizeof("collation")-1);
-                yajl_gen_string(g, (const unsigned char *)collations[column->collation], 2);
-            }
-            yajl_gen_map_close(g);
-        }
-        fmp_free_columns(columns);
-        yajl_gen_array_close(g);
-        yajl_gen_string(g, (const unsigned char *)"values", sizeof("values")-1);
-
-        yajl_gen_array_open(g);
-        ctx.last_row = 0;
-        error = fmp_read_values(file, table, &handle_value, &ctx);
-        if (error != FMP_OK) {
-            fprintf(stderr, "Error code: %d\n", error);
-            return 1;
-        }
-        if (ctx.last_row)
-            yajl_gen_map_close(g);
-        yajl_gen_array_close(g);
-
-        yajl_gen_map_close(g);
+    error = fmp_read_all_values(file, tables, &handle_table, &handle_value, &ctx);
+    if (error != FMP_OK) {
+        fprintf(stderr, "Error code: %d\n", error);
+        return 1;
     }
+    close_table(&ctx);
     yajl_gen_array_close(g);
     fmp_free_tables(tables);
     fmp_close_file(file);
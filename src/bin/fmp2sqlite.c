@@ -33,11 +33,13 @@
 typedef struct fmp_sqlite_ctx_s {
     sqlite3 *db;
     sqlite3_stmt *insert_stmt;
-    char *table_name;
+    char *create_query;
+    char *insert_query;
     int last_row;
 } fmp_sqlite_ctx_t;
 
-fmp_handler_status_t handle_value(int row, fmp_column_t *column, const char *value, void *ctxp) {
+fmp_handler_status_t handle_value(fmp_table_t *table, int row, fmp_column_t *column,
+        const char *value, void *ctxp) {
     fmp_sqlite_ctx_t *ctx = (fmp_sqlite_ctx_t *)ctxp;
     if (ctx->last_row != row && ctx->last_row > 0) {
         int rc = sqlite3_step(ctx->insert_stmt);
@@ -92,6 +94,87 @@ static size_t insert_query_length(fmp_table_t *table, fmp_column_array_t *column
     return len;
 }
 
+/* Inserts the last row of the table being written, if any */
+static int finish_table(fmp_sqlite_ctx_t *ctx) {
+    if (!ctx->insert_stmt)
+        return 0;
+    if (ctx->last_row) {
+        int rc = sqlite3_step(ctx->insert_stmt);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error inserting data into SQLite table: %s\n", sqlite3_errmsg(ctx->db));
+            return -1;
+        }
+    }
+    sqlite3_finalize(ctx->insert_stmt);
+    ctx->insert_stmt = NULL;
+    ctx->last_row = 0;
+    return 0;
+}
+
+fmp_handler_status_t handle_table(fmp_table_t *table, fmp_column_array_t *columns, void *ctxp) {
+    fmp_sqlite_ctx_t *ctx = (fmp_sqlite_ctx_t *)ctxp;
+    char *zErrMsg = NULL;
+    if (finish_table(ctx) != 0)
+        return FMP_HANDLER_ABORT;
+
+    size_t create_query_len = create_query_length(table, columns);
+    size_t insert_query_len = insert_query_length(table, columns);
+    char *create_query = realloc(ctx->create_query, create_query_len);
+    if (create_query)
+        ctx->create_query = create_query;
+    char *insert_query = realloc(ctx->insert_query, insert_query_len);
+    if (insert_query)
+        ctx->insert_query = insert_query;
+    if (!create_query || !insert_query)
+        return FMP_HANDLER_ABORT;
+
+    char *p = create_query;
+    char *q = insert_query;
+    p += snprintf(p, create_query_len, "CREATE TABLE \"%s\" (", table->utf8_name);
+    q += snprintf(q, insert_query_len, "INSERT INTO \"%s\" (", table->utf8_name);
+    for (int j=0; j<columns->count; j++) {
+        fmp_column_t *column = &columns->columns[j];
+        char *colname = strdup(column->utf8_name);
+        size_t colname_len = strlen(colname);
+        for (int k=0; k<colname_len; k++) {
+            if (colname[k] == ' ')
+                colname[k] = '_';
+        }
+        p += snprintf(p, create_query_len - (p - create_query), "\"%s\" TEXT", colname);
+        q += snprintf(q, insert_query_len - (q - insert_query), "\"%s\"", colname);
+        if (j < columns->count - 1) {
+            p += snprintf(p, create_query_len - (p - create_query), ", ");
+            q += snprintf(q, insert_query_len - (q - insert_query), ", ");
+        }
+        free(colname);
+    }
+    p += snprintf(p, create_query_len - (p - create_query), ");");
+    q += snprintf(q, insert_query_len - (q - insert_query), ") VALUES (");
+    for (int j=0; j<columns->count; j++) {
+        fmp_column_t *column = &columns->columns[j];
+        q += snprintf(q, insert_query_len - (q - insert_query), "?%d", column->index);
+        if (j < columns->count - 1)
+            q += snprintf(q, insert_query_len - (q - insert_query), ", ");
+    }
+    q += snprintf(q, insert_query_len - (q - insert_query), ");");
+
+    fprintf(stderr, "CREATE TABLE \"%s\"\n", table->utf8_name);
+    int rc = sqlite3_exec(ctx->db, create_query, NULL, NULL, &zErrMsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Error creating SQL table: %s\n", zErrMsg);
+        fprintf(stderr, "Statement was: %s\n", create_query);
+        return FMP_HANDLER_ABORT;
+    }
+
+    rc = sqlite3_prepare_v2(ctx->db, insert_query, -1, &ctx->insert_stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Error preparing SQL statement: %d\n", rc);
+        fprintf(stderr, "Statement was: %s\n", insert_query);
+        return FMP_HANDLER_ABORT;
+    }
+    return FMP_HANDLER_OK;
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 3) {
         print_usage_and_exit(argc, argv);
@@ -100,7 +183,7 @@ int main(int argc, char *argv[]) {
     sqlite3 *db = NULL;
     char *zErrMsg = NULL;
     fmp_error_t error = FMP_OK;
-    fmp_file_t *file = fmp_open_file(argv[1], &error);
+    fmp_file_t *file = open_input_file(argv[1], &error);
     if (!file) {
         fprintf(stderr, "Error code: %d\n", error);
         return 1;
@@ -131,82 +214,17 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    char *create_query = NULL;
-    char *insert_query = NULL;
-
-    for (int i=0; i<tables->count; i++) {
-        fmp_table_t *table = &tables->tables[i];
-        fmp_column_array_t *columns = fmp_list_columns(file, table, &error);
-        if (!columns) {
-            fprintf(stderr, "Error code: %d\n", error);
-            return 1;
-        }
-        size_t create_query_len = create_query_length(table, columns);
-        size_t insert_query_len = insert_query_length(table, columns);
-        create_query = realloc(create_query, create_query_len);
-        insert_query = realloc(insert_query, insert_query_len);
-
-        char *p = create_query;
-        char *q = insert_query;
-        p += snprintf(p, create_query_len, "CREATE TABLE \"%s\" (", table->utf8_name);
-        q += snprintf(q, insert_query_len, "INSERT INTO \"%s\" (", table->utf8_name);
-        for (int j=0; j<columns->count; j++) {
-            fmp_column_t *column = &columns->columns[j];
-            char *colname = strdup(column->utf8_name);
-            size_t colname_len = strlen(colname);
-            for (int k=0; k<colname_len; k++) {
-                if (colname[k] == ' ')
-                    colname[k] = '_';
-            }
-            p += snprintf(p, create_query_len - (p - create_query), "\"%s\" TEXT", colname);
-            q += snprintf(q, insert_query_len - (q - insert_query), "\"%s\"", colname);
-            if (j < columns->count - 1) {
-                p += snprintf(p, create_query_len - (p - create_query), ", ");
-                q += snprintf(q, insert_query_len - (q - insert_query), ", ");
-            }
-            free(colname);
-        }
-        p += snprintf(p, create_query_len - (p - create_query), ");");
-        q += snprintf(q, insert_query_len - (q - insert_query), ") VALUES (");
-        for (int j=0; j<columns->count; j++) {
-            fmp_column_t *column = &columns->columns[j];
-            q += snprintf(q, insert_query_len - (q - insert_query), "?%d", column->index);
-            if (j < columns->count - 1)
-                q += snprintf(q, insert_query_len - (q - insert_query), ", ");
-        }
-        q += snprintf(q, insert_query_len - (q - insert_query), ");");
-
-        fprintf(stderr, "CREATE TABLE \"%s\"\n", table->utf8_name);
-        rc = sqlite3_exec(db, create_query, NULL, NULL, &zErrMsg);
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "Error creating SQL table: %s\n", zErrMsg);
-            fprintf(stderr, "Statement was: %s\n", create_query);
-            return 1;
-        }
-
-        sqlite3_stmt *stmt = NULL;
-        rc = sqlite3_prepare_v2(db, insert_query, -1, &stmt, NULL);
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "Error preparing SQL statement: %d\n", rc);
-            fprintf(stderr, "Statement was: %s\n", insert_query);
-            return 1;
-        }
-
-        fmp_sqlite_ctx_t ctx = { .db = db, .table_name = table->utf8_name, .insert_stmt = stmt };
-        fmp_read_values(file, table, &handle_value, &ctx);
-        if (ctx.last_row) {
-            int rc = sqlite3_step(stmt);
-            if (rc != SQLITE_DONE) {
-                fprintf(stderr, "Error inserting data into SQLite table: %s\n", sqlite3_errmsg(db));
-                return 1;
-            }
-        }
-        sqlite3_finalize(stmt);
-        fmp_free_columns(columns);
+    fmp_sqlite_ctx_t ctx = { .db = db };
+    error = fmp_read_all_values(file, tables, &handle_table, &handle_value, &ctx);
+    if (error != FMP_OK) {
+        fprintf(stderr, "Error code: %d\n", error);
+        return 1;
     }
+    if (finish_table(&ctx) != 0)
+        return 1;
 
-    free(create_query);
-    free(insert_query);
+    free(ctx.create_query);
+    free(ctx.insert_query);
     fmp_free_tables(tables);
     sqlite3_close(db);
     fmp_close_file(file);
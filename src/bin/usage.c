@@ -3,12 +3,24 @@
 #include <stdlib.h>
 #include <libgen.h>
 
+#include "../fmp.h"
+
 void print_usage_and_exit(int argc, char *argv[]) {
     if (argc == 2 && strcmp(argv[1], "--version") == 0) {
         printf("FMP Tools version %s\n", VERSION);
         printf("Copyright 2020 Evan Miller\n");
         printf("https://github.com/evanmiller/fmptools\n\n");
     }
-    printf("Usage: %s [input file] [output file]\n", basename(argv[0]));
+    printf("Usage: %s [input file or -] [output file]\n", basename(argv[0]));
     exit(1);
 }
+
+/* "-" reads the database from standard input, holding as many sectors in
+ * memory as for a compressed file before spilling the rest to disk */
+fmp_file_t *open_input_file(const char *path, fmp_error_t *errorCode) {
+    if (strcmp(path, "-") == 0) {
+        fmp_open_options_t options = { .stream_memory_blocks = 256 };
+        return fmp_open_stream(stdin, &options, errorCode);
+    }
+    return fmp_open_file(path, errorCode);
+}
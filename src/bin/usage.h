@@ -1 +1,4 @@
+#include "../fmp.h"
+
 void print_usage_and_exit(int argc, char *argv[]);
+fmp_file_t *open_input_file(const char *path, fmp_error_t *errorCode);
@@ -48,435 +48,488 @@ static uint64_t copy_path_int(const void *buf, size_t int_len) {
     return 0;
 }
 
-static fmp_error_t process_block_v7(fmp_block_t *block) {
-    fmp_chunk_t *last_chunk = NULL;
-    fmp_chunk_t *first_chunk = NULL;
+/* Chunks are decoded into one list on the file that is reused for every
+ * block, so a scan only ever holds a single block's chunks, however large
+ * the file. The list keeps each field in its own array, with data as
+ * offsets into the payload, so a decoded chunk costs 16 bytes. Every chunk
+ * takes at least one byte of payload, so reserving one chunk per byte up
+ * front means the decoders never have to check for room. Masked files get
+ * room for the unmasked payload in the same allocation. */
+static fmp_chunk_list_t *reserve_chunks(fmp_file_t *file, fmp_block_t *block) {
+    fmp_chunk_list_t *list = file->scan_chunks;
+    size_t payload_len = block->payload_len;
+    if (!list && !(list = file->scan_chunks = calloc(1, sizeof(fmp_chunk_list_t))))
+        return NULL;
+    if (payload_len > list->capacity) {
+        size_t per_chunk = 2 * sizeof(uint32_t) + 2 * sizeof(uint16_t) + 4 + (file->xor_mask != 0);
+        uint8_t *storage = malloc(payload_len * per_chunk);
+        if (!storage)
+            return NULL;
+        free(list->data_offset);
+        list->data_offset = (uint32_t *)storage;
+        list->ref_long_offset = list->data_offset + payload_len;
+        list->data_len = (uint16_t *)(list->ref_long_offset + payload_len);
+        list->key = list->data_len + payload_len;
+        list->ref_long_len = (uint8_t *)(list->key + payload_len);
+        list->type = list->ref_long_len + payload_len;
+        list->code = list->type + payload_len;
+        list->flags = list->code + payload_len;
+        list->unmasked = file->xor_mask ? list->flags + payload_len : NULL;
+        list->capacity = payload_len;
+    }
+    list->count = 0;
+    list->payload = block->payload;
+    list->payload_len = payload_len;
+    list->unmasked_ready = 0;
+    return list;
+}
+
+void free_chunk_list(fmp_chunk_list_t *list) {
+    if (!list)
+        return;
+    free(list->data_offset);
+    free(list);
+}
+
+/* fp7 and fmp12 mask their strings, but opcodes, keys and paths are stored
+ * as-is, so chunks point into the raw payload. The first time a handler
+ * asks for a value from the current block, the whole payload is unmasked
+ * into the scan buffer; blocks the handlers skip are never touched. */
+uint8_t *unmask_data(fmp_file_t *file, fmp_data_t *data) {
+    fmp_chunk_list_t *list = file->scan_chunks;
+    if (!file->xor_mask)
+        return data->bytes;
+    if (!list->unmasked_ready) {
+        unmask_bytes(list->unmasked, list->payload, list->payload_len, file->xor_mask);
+        list->unmasked_ready = 1;
+    }
+    return list->unmasked + (data->bytes - list->payload);
+}
+
+static void add_chunk(fmp_chunk_list_t *list, uint8_t type, uint8_t code, uint16_t key,
+        const uint8_t *data, size_t data_len, const uint8_t *ref_long, size_t ref_long_len,
+        uint8_t flags) {
+    size_t i = list->count++;
+    list->type[i] = type;
+    list->code[i] = code;
+    list->key[i] = key;
+    list->data_offset[i] = data - list->payload;
+    list->data_len[i] = data_len;
+    list->ref_long_offset[i] = ref_long - list->payload;
+    list->ref_long_len[i] = ref_long_len;
+    list->flags[i] = flags;
+}
+
+/* fmp12 opcodes, transcribed from "fmp12 Codes" in HACKING. The table maps
+ * each opcode byte to its class, which fixes the layout of the key and data
+ * that follow, and to a size: the data length for fixed-length classes, or
+ * the number of bytes skipped after the data for SIMPLE_VAR. Zeroed entries
+ * are unrecognized codes. */
+
+typedef enum {
+    OP_UNKNOWN = 0,
+    OP_END,             /* 0x00: one byte of data, or the end of the block */
+    OP_NOOP,
+    OP_SIMPLE,
+    OP_SIMPLE_VAR,
+    OP_KV,              /* 1-byte key */
+    OP_KV_VAR,
+    OP_KV_PATH,         /* 2-byte path integer key */
+    OP_KV_PATH_VAR,
+    OP_SEGMENT,         /* 1-byte segment index, 2-byte length */
+    OP_SEGMENT_PATH,    /* path integer segment index, 2-byte length */
+    OP_LONG_KV3,        /* 3-byte key, 1-byte length */
+    OP_LONG_KV3_WORD,   /* 3-byte key, 2-byte length */
+    OP_LONG_KV,         /* length-prefixed key, 1-byte length */
+    OP_LONG_KV_WORD,    /* length-prefixed key, 2-byte length */
+    OP_PUSH,
+    OP_PUSH_VAR,
+    OP_PUSH_SHORT,      /* 1 byte, or 8 bytes after a 0xFE marker */
+    OP_POP
+} opcode_class_t;
+
+typedef struct opcode_s {
+    uint8_t op_class;
+    uint8_t size;
+} opcode_t;
+
+static const opcode_t v7_opcodes[256] = {
+    [0x00] = { OP_END, 1 },
+    [0x01] = { OP_KV, 1 },
+    [0x02] = { OP_KV, 2 },
+    [0x03] = { OP_KV, 4 },
+    [0x04] = { OP_KV, 6 },
+    [0x05] = { OP_KV, 8 },
+    [0x06] = { OP_KV_VAR },
+    [0x07] = { OP_SEGMENT },
+    [0x08] = { OP_SIMPLE, 2 },
+    [0x09] = { OP_KV_PATH, 1 },
+    [0x0A] = { OP_KV_PATH, 2 },
+    [0x0B] = { OP_KV_PATH, 4 },
+    [0x0C] = { OP_KV_PATH, 6 },
+    [0x0D] = { OP_KV_PATH, 8 },
+    [0x0E] = { OP_KV_PATH_VAR }, /* but 0x0E 0xFF is 6 bytes of simple data */
+    [0x0F] = { OP_SEGMENT_PATH },
+    [0x10] = { OP_SIMPLE, 3 },
+    [0x11] = { OP_SIMPLE, 4 },
+    [0x12] = { OP_SIMPLE, 5 },
+    [0x13] = { OP_SIMPLE, 7 },
+    [0x14] = { OP_SIMPLE, 9 },
+    [0x15] = { OP_SIMPLE, 11 },
+    [0x16] = { OP_LONG_KV3 },
+    [0x17] = { OP_LONG_KV3_WORD },
+    [0x19] = { OP_SIMPLE_VAR, 1 },
+    [0x1A] = { OP_SIMPLE_VAR, 2 },
+    [0x1B] = { OP_SIMPLE_VAR, 4 },
+    [0x1C] = { OP_SIMPLE_VAR, 6 },
+    [0x1D] = { OP_SIMPLE_VAR, 8 },
+    [0x1E] = { OP_LONG_KV },
+    [0x1F] = { OP_LONG_KV_WORD },
+    [0x20] = { OP_PUSH_SHORT },
+    [0x23] = { OP_SIMPLE_VAR, 0 },
+    [0x28] = { OP_PUSH, 2 },
+    [0x30] = { OP_PUSH, 3 },
+    [0x38] = { OP_PUSH_VAR },
+    [0x3D] = { OP_POP },
+    [0x40] = { OP_POP },
+    [0x80] = { OP_NOOP },
+    [0xE0] = { OP_PUSH_SHORT },
+};
+
+/* Bytes that must follow the opcode before the data itself */
+static const uint8_t v7_header_len[] = {
+    [OP_KV] = 1, [OP_KV_VAR] = 2, [OP_KV_PATH] = 2, [OP_KV_PATH_VAR] = 3,
+    [OP_SEGMENT] = 3, [OP_SEGMENT_PATH] = 4, [OP_LONG_KV3] = 4, [OP_LONG_KV3_WORD] = 5,
+    [OP_LONG_KV] = 1, [OP_LONG_KV_WORD] = 1, [OP_SIMPLE_VAR] = 1,
+    [OP_PUSH_VAR] = 1, [OP_PUSH_SHORT] = 1, [OP_POP] = 0
+};
+
+static fmp_error_t process_block_v7(fmp_file_t *file, fmp_block_t *block, fmp_chunk_list_t **chunks) {
+    fmp_chunk_list_t *list = reserve_chunks(file, block);
+    if (!list)
+        return FMP_ERROR_MALLOC;
     unsigned char *p = block->payload;
     unsigned char *end = block->payload + block->payload_len;
     fmp_error_t retval = FMP_OK;
-    unsigned char c;
-    while (p < block->payload + block->payload_len) {
-        c = *p;
-        fmp_chunk_t *chunk = calloc(1, sizeof(fmp_chunk_t));
-        chunk->code = c;
-        if (c == 0x00) {
-            chunk->type = FMP_CHUNK_DATA_SIMPLE;
-            p++;
-            if (p >= end || *p == 0x00) {
-                free(chunk); // done
-                break;
-            }
-            chunk->data.bytes = p;
-            chunk->data.len = c + 1;
-            p += chunk->data.len;
-        } else if (c <= 0x05) {
-            chunk->type = FMP_CHUNK_FIELD_REF_SIMPLE;
-            p++;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+    while (p < end) {
+        unsigned char c = *p++;
+        opcode_t op = v7_opcodes[c];
+        if (op.op_class == OP_NOOP)
+            continue;
+        if (op.op_class == OP_UNKNOWN) {
+            p--;
+            debug(" **** UNRECOGNIZED CODE 0x%02x @ [%llu] *****\n", c, p - block->payload);
+            retval = FMP_ERROR_UNRECOGNIZED_CODE;
+            break;
+        }
+        if (op.op_class == OP_END && (p >= end || *p == 0x00))
+            break;
+        if (c == 0x0E && p < end && *p == 0xFF)
+            op = (opcode_t){ OP_SIMPLE, 6 };
+        if (p + v7_header_len[op.op_class] > end) {
+            retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
+            break;
+        }
+        fmp_chunk_type_t type = FMP_CHUNK_DATA_SIMPLE;
+        uint16_t key = 0;
+        size_t len = 0, skip = 0;
+        unsigned char *ref_long = p;
+        size_t ref_long_len = 0;
+        switch (op.op_class) {
+            case OP_END:
+            case OP_SIMPLE:
+                len = op.size;
                 break;
-            }
-            chunk->ref_simple = *p++;
-            chunk->data.bytes = p;
-            chunk->data.len = (c == 0x01) + 2*(c-0x01);
-            p += chunk->data.len;
-        } else if (c == 0x06) {
-            chunk->type = FMP_CHUNK_FIELD_REF_SIMPLE;
-            p++;
-            if (p + 2 > end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_SIMPLE_VAR:
+                len = *p++;
+                skip = op.size;
                 break;
-            }
-            chunk->ref_simple = *p++;
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x07) {
-            chunk->type = FMP_CHUNK_DATA_SEGMENT;
-            p++;
-            if (p + 3 > end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_KV:
+                type = FMP_CHUNK_FIELD_REF_SIMPLE;
+                key = *p++;
+                len = op.size;
                 break;
-            }
-            chunk->segment_index = *p++;
-            chunk->data.len = copy_int(p, 2);
-            p += 2;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x08) {
-            chunk->type = FMP_CHUNK_DATA_SIMPLE;
-            p++;
-            chunk->data.bytes = p;
-            chunk->data.len = 2;
-            p += chunk->data.len;
-        } else if (c == 0x0E && p[1] == 0xFF) {
-            chunk->type = FMP_CHUNK_DATA_SIMPLE;
-            p++;
-            chunk->data.bytes = p;
-            chunk->data.len = 6;
-            p += chunk->data.len;
-        } else if (c <= 0x0D) {
-            chunk->type = FMP_CHUNK_FIELD_REF_SIMPLE;
-            p++;
-            if (p + 2 > end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_KV_VAR:
+                type = FMP_CHUNK_FIELD_REF_SIMPLE;
+                key = p[0];
+                len = p[1];
+                p += 2;
                 break;
-            }
-            chunk->ref_simple = copy_path_int(p, 2);
-            p += 2;
-            chunk->data.bytes = p;
-            chunk->data.len = (c == 0x09) + 2*(c-0x09);
-            p += chunk->data.len;
-        } else if (c == 0x0E) {
-            chunk->type = FMP_CHUNK_FIELD_REF_SIMPLE;
-            p++;
-            if (p + 3 > end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_KV_PATH:
+                type = FMP_CHUNK_FIELD_REF_SIMPLE;
+                key = copy_path_int(p, 2);
+                len = op.size;
+                p += 2;
                 break;
-            }
-            chunk->ref_simple = copy_path_int(p, 2);
-            p += 2;
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x0F) {
-            chunk->type = FMP_CHUNK_DATA_SEGMENT;
-            p++;
-            if (p + 4 > end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_KV_PATH_VAR:
+                type = FMP_CHUNK_FIELD_REF_SIMPLE;
+                key = copy_path_int(p, 2);
+                len = p[2];
+                p += 3;
                 break;
-            }
-            chunk->segment_index = copy_path_int(p, 2);
-            p += 2;
-            chunk->data.len = copy_int(p, 2);
-            p += 2;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x10) {
-            chunk->type = FMP_CHUNK_DATA_SIMPLE;
-            p++;
-            chunk->data.bytes = p;
-            chunk->data.len = 3;
-            p += chunk->data.len;
-        } else if (c >= 0x11 && c <= 0x15) {
-            chunk->type = FMP_CHUNK_DATA_SIMPLE;
-            p++;
-            chunk->data.bytes = p;
-            chunk->data.len = 3 + (c == 0x11) + 2*(c-0x11);
-            p += chunk->data.len;
-        } else if (c == 0x16) {
-            chunk->type = FMP_CHUNK_FIELD_REF_LONG;
-            p++;
-            chunk->ref_long.bytes = p;
-            chunk->ref_long.len = 3;
-            p += chunk->ref_long.len;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_SEGMENT:
+                type = FMP_CHUNK_DATA_SEGMENT;
+                key = p[0];
+                len = copy_int(&p[1], 2);
+                p += 3;
                 break;
-            }
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x17) {
-            chunk->type = FMP_CHUNK_FIELD_REF_LONG;
-            p++;
-            chunk->ref_long.bytes = p;
-            chunk->ref_long.len = 3;
-            p += chunk->ref_long.len;
-            if (p + 2 > end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_SEGMENT_PATH:
+                type = FMP_CHUNK_DATA_SEGMENT;
+                key = copy_path_int(p, 2);
+                len = copy_int(&p[2], 2);
+                p += 4;
                 break;
-            }
-            chunk->data.len = copy_int(p, 2);
-            p += 2;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c >= 0x19 && c <= 0x1D) {
-            chunk->type = FMP_CHUNK_DATA_SIMPLE;
-            p++;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_LONG_KV3:
+                type = FMP_CHUNK_FIELD_REF_LONG;
+                ref_long_len = 3;
+                len = p[3];
+                p += 4;
                 break;
-            }
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len + (c == 0x19) + 2*(c-0x19);
-        } else if (c == 0x1E) {
-            chunk->type = FMP_CHUNK_FIELD_REF_LONG;
-            p++;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_LONG_KV3_WORD:
+                type = FMP_CHUNK_FIELD_REF_LONG;
+                ref_long_len = 3;
+                len = copy_int(&p[3], 2);
+                p += 5;
                 break;
-            }
-            chunk->ref_long.len = *p++;
-            chunk->ref_long.bytes = p;
-            p += chunk->ref_long.len;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_LONG_KV:
+            case OP_LONG_KV_WORD:
+                type = FMP_CHUNK_FIELD_REF_LONG;
+                ref_long_len = *p++;
+                ref_long = p;
+                p += ref_long_len;
+                if (op.op_class == OP_LONG_KV) {
+                    if (p + 1 > end)
+                        goto truncated;
+                    len = *p++;
+                } else {
+                    if (p + 2 > end)
+                        goto truncated;
+                    len = copy_int(p, 2);
+                    p += 2;
+                }
                 break;
-            }
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x1F) {
-            chunk->type = FMP_CHUNK_FIELD_REF_LONG;
-            p++;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_PUSH:
+                type = FMP_CHUNK_PATH_PUSH;
+                len = op.size;
                 break;
-            }
-            chunk->ref_long.len = *p++;
-            chunk->ref_long.bytes = p;
-            p += chunk->ref_long.len;
-            if (p + 2 > end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_PUSH_VAR:
+                type = FMP_CHUNK_PATH_PUSH;
+                len = *p++;
                 break;
-            }
-            chunk->data.len = copy_int(p, 2);
-            p += 2;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x20 || c == 0xE0) {
-            chunk->type = FMP_CHUNK_PATH_PUSH;
-            p++;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
-                break;
-            }
-            if (*p == 0xFE) {
-                p++;
-                chunk->data.len = 8;
-            } else {
-                chunk->data.len = 1;
-            }
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x23) {
-            chunk->type = FMP_CHUNK_DATA_SIMPLE;
-            p++;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_PUSH_SHORT:
+                type = FMP_CHUNK_PATH_PUSH;
+                len = 1;
+                if (*p == 0xFE) {
+                    p++;
+                    len = 8;
+                }
                 break;
-            }
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x28) {
-            chunk->type = FMP_CHUNK_PATH_PUSH;
-            p++;
-            chunk->data.bytes = p;
-            chunk->data.len = 2;
-            p += chunk->data.len;
-        } else if (c == 0x30) {
-            chunk->type = FMP_CHUNK_PATH_PUSH;
-            p++;
-            chunk->data.bytes = p;
-            chunk->data.len = 3;
-            p += chunk->data.len;
-        } else if (c == 0x38) {
-            chunk->type = FMP_CHUNK_PATH_PUSH;
-            p++;
-            if (p >= end) {
-                retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
+            case OP_POP:
+                type = FMP_CHUNK_PATH_POP;
                 break;
-            }
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
-        } else if (c == 0x3d || c == 0x40) {
-            chunk->type = FMP_CHUNK_PATH_POP;
-            p++;
-        } else if (c == 0x80) {
-            p++;
-            free(chunk);
-            continue;
-        } else {
-            debug(" **** UNRECOGNIZED CODE 0x%02x @ [%llu] *****\n", c, p - block->payload);
-            free(chunk);
-            retval = FMP_ERROR_UNRECOGNIZED_CODE;
-            break;
-        }
-        if (last_chunk) {
-            last_chunk->next = chunk;
         }
-        if (!first_chunk) {
-            first_chunk = chunk;
-        }
-        last_chunk = chunk;
+        add_chunk(list, type, c, key, p, len, ref_long, ref_long_len, 0);
+        p += len + skip;
+        continue;
+truncated:
+        retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
+        break;
     }
     if (p > block->payload + block->payload_len) {
         retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
     }
-    block->chunk = first_chunk;
+    *chunks = list;
     return retval;
 }
 
-static fmp_error_t process_block_v3(fmp_block_t *block) {
-    fmp_chunk_t *last_chunk = NULL;
-    fmp_chunk_t *first_chunk = NULL;
+static fmp_error_t process_block_v3(fmp_file_t *file, fmp_block_t *block, fmp_chunk_list_t **chunks) {
+    fmp_chunk_list_t *list = reserve_chunks(file, block);
+    if (!list)
+        return FMP_ERROR_MALLOC;
     unsigned char *p = block->payload;
     unsigned char *end = block->payload + block->payload_len;
     fmp_error_t retval = FMP_OK;
     while (p < end) {
         unsigned char c = *p;
-        fmp_chunk_t *chunk = calloc(1, sizeof(fmp_chunk_t));
-        chunk->code = c;
+        unsigned char code = c;
+        fmp_chunk_type_t type;
+        uint16_t key = 0;
+        uint8_t flags = 0;
+        size_t len = 0;
+        unsigned char *data = p;
+        unsigned char *ref_long = p;
+        size_t ref_long_len = 0;
         if (c == 0x00) {
-            chunk->type = FMP_CHUNK_FIELD_REF_SIMPLE;
+            type = FMP_CHUNK_FIELD_REF_SIMPLE;
             p++;
             if (p >= end) {
                 retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
                 break;
             }
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
+            len = *p++;
+            data = p;
+            p += len;
         } else if (c == 0x01 && p[1] == 0xFF && p[2] == 0x05) {
             p += 8; // length check
-            free(chunk);
             continue;
         } else if (c < 0x40) {
-            chunk->type = FMP_CHUNK_FIELD_REF_LONG;
-            chunk->ref_long.len = *p++;
-            chunk->ref_long.bytes = p;
-            p += chunk->ref_long.len;
+            type = FMP_CHUNK_FIELD_REF_LONG;
+            ref_long_len = *p++;
+            ref_long = p;
+            p += ref_long_len;
             if (p >= end) {
                 retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
                 break;
             }
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
+            len = *p++;
+            data = p;
+            p += len;
         } else if (c < 0x80) {
-            chunk->type = FMP_CHUNK_FIELD_REF_SIMPLE;
-            chunk->ref_simple = *(p++) - 0x40;
+            type = FMP_CHUNK_FIELD_REF_SIMPLE;
+            key = *(p++) - 0x40;
             if (p >= end) {
                 retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
                 break;
             }
-            chunk->data.len = *p++;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
+            len = *p++;
+            data = p;
+            p += len;
         } else if (c < 0xC0) {
-            chunk->type = FMP_CHUNK_DATA_SIMPLE;
-            chunk->data.len = *(p++) - 0x80;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
+            type = FMP_CHUNK_DATA_SIMPLE;
+            len = *(p++) - 0x80;
+            data = p;
+            p += len;
         } else if (c == 0xC0) {
-            chunk->type = FMP_CHUNK_PATH_POP;
+            type = FMP_CHUNK_PATH_POP;
             p++;
         } else if (c < 0xFF) {
-            chunk->type = FMP_CHUNK_PATH_PUSH;
-            chunk->data.len = *(p++) - 0xC0;
-            chunk->data.bytes = p;
-            p += chunk->data.len;
+            type = FMP_CHUNK_PATH_PUSH;
+            len = *(p++) - 0xC0;
+            data = p;
+            p += len;
         } else { // c == 0xFF
             if (p >= end) {
                 retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                free(chunk);
                 break;
             }
             c = *++p;
             if (!c) {
                 fprintf(stderr, "Bad 0xFF chunk: %02x!\n", c);
-                free(chunk);
                 break;
             } else if (c <= 0x04) {
-                chunk->type = FMP_CHUNK_FIELD_REF_LONG;
-                chunk->ref_long.len = *p++;
-                chunk->ref_long.bytes = p;
-                p += chunk->ref_long.len;
+                type = FMP_CHUNK_FIELD_REF_LONG;
+                ref_long_len = *p++;
+                ref_long = p;
+                p += ref_long_len;
                 if (p + 1 >= end) {
                     retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                    free(chunk);
                     break;
                 }
-                chunk->data.len = copy_int(p, 2);
-                chunk->data.bytes = (p += 2);
-                p += chunk->data.len;
+                len = copy_int(p, 2);
+                data = (p += 2);
+                p += len;
             } else if (c >= 0x40 && c <= 0x80) {
-                chunk->type = FMP_CHUNK_FIELD_REF_SIMPLE;
-                chunk->ref_simple = *(p++) - 0x40;
+                type = FMP_CHUNK_FIELD_REF_SIMPLE;
+                key = *(p++) - 0x40;
                 if (p + 1 >= end) {
                     retval = FMP_ERROR_DATA_EXCEEDS_SECTOR_SIZE;
-                    free(chunk);
                     break;
                 }
-                chunk->data.len = copy_int(p, 2);
-                chunk->data.bytes = (p += 2);
-                p += chunk->data.len;
+                len = copy_int(p, 2);
+                data = (p += 2);
+                p += len;
             } else {
                 fprintf(stderr, "Bad 0xFF chunk: %02x!\n", c);
-                free(chunk);
                 break;
             }
-            chunk->extended = 1;
-        }
-        if (chunk->type == FMP_CHUNK_FIELD_REF_LONG && chunk->ref_long.len == 1) {
-            chunk->type = FMP_CHUNK_FIELD_REF_SIMPLE;
-            chunk->ref_simple = chunk->ref_long.bytes[0];
+            flags = CHUNK_EXTENDED;
         }
-        if (last_chunk) {
-            last_chunk->next = chunk;
+        if (type == FMP_CHUNK_FIELD_REF_LONG && ref_long_len == 1) {
+            type = FMP_CHUNK_FIELD_REF_SIMPLE;
+            key = ref_long[0];
         }
-        if (!first_chunk) {
-            first_chunk = chunk;
-        }
-        last_chunk = chunk;
+        add_chunk(list, type, code, key, data, len, ref_long, ref_long_len, flags);
     }
     if (p != block->payload + block->payload_len) {
         retval = FMP_ERROR_BAD_SECTOR;
     }
-    block->chunk = first_chunk;
+    *chunks = list;
     return retval;
 }
 
-fmp_error_t process_block(fmp_file_t *file, fmp_block_t *block) {
+/* The chunks are only good until the next call */
+fmp_error_t process_block(fmp_file_t *file, fmp_block_t *block, fmp_chunk_list_t **chunks) {
+    *chunks = NULL;
     if (!block)
         return FMP_ERROR_BAD_SECTOR;
 
-    if (block->chunk) // already processed
-        return FMP_OK;
-
     if (file->version_num >= 7)
-        return process_block_v7(block);
-    return process_block_v3(block);
+        return process_block_v7(file, block, chunks);
+    return process_block_v3(file, block, chunks);
 }
 
-fmp_block_t *new_block_from_sector(fmp_file_t *file, const uint8_t *sector, fmp_error_t *errorCode) {
+static size_t sector_payload_len(fmp_file_t *file, const uint8_t *sector, fmp_error_t *errorCode) {
     size_t payload_len = file->sector_size - file->sector_head_len;
     if (file->payload_len_offset != -1)
         payload_len = copy_int(&sector[file->payload_len_offset], 2);
     if (payload_len > file->sector_size - file->sector_head_len) {
         if (errorCode)
             *errorCode = FMP_ERROR_BAD_SECTOR;
-        return NULL;
+        return -1;
     }
-    fmp_block_t *block = calloc(1, sizeof(fmp_block_t) + payload_len);
-    block->payload_len = payload_len;
+    return payload_len;
+}
+
+static void read_sector_header(fmp_file_t *file, fmp_block_t *block, const uint8_t *sector) {
     block->deleted = sector[0];
     block->level = sector[1];
     block->prev_id = copy_int(&sector[file->prev_sector_offset], 4);
     block->next_id = copy_int(&sector[file->next_sector_offset], 4);
-    memcpy(&block->payload, &sector[file->sector_head_len], payload_len);
+}
+
+fmp_block_t *new_block_from_sector(fmp_file_t *file, const uint8_t *sector, fmp_error_t *errorCode) {
+    size_t payload_len = sector_payload_len(file, sector, errorCode);
+    if (payload_len == -1)
+        return NULL;
+    fmp_block_t *block = calloc(1, sizeof(fmp_block_t) + payload_len);
+    if (!block) {
+        if (errorCode)
+            *errorCode = FMP_ERROR_MALLOC;
+        return NULL;
+    }
+    read_sector_header(file, block, sector);
+    block->payload_len = payload_len;
+    block->payload = (uint8_t *)&block[1];
+    memcpy(block->payload, &sector[file->sector_head_len], payload_len);
+    return block;
+}
+
+/* Fills in a block whose payload points into the sector rather than
+ * being copied, so the sector must outlive the block. */
+fmp_error_t init_block_in_sector(fmp_file_t *file, fmp_block_t *block, const uint8_t *sector) {
+    fmp_error_t retval = FMP_OK;
+    size_t payload_len = sector_payload_len(file, sector, &retval);
+    if (payload_len == -1)
+        return retval;
+    read_sector_header(file, block, sector);
+    block->payload_len = payload_len;
+    block->payload = (uint8_t *)&sector[file->sector_head_len];
+    return FMP_OK;
+}
+
+fmp_block_t *new_block_in_sector(fmp_file_t *file, const uint8_t *sector, fmp_error_t *errorCode) {
+    fmp_block_t *block = calloc(1, sizeof(fmp_block_t));
+    if (!block) {
+        if (errorCode)
+            *errorCode = FMP_ERROR_MALLOC;
+        return NULL;
+    }
+    fmp_error_t retval = init_block_in_sector(file, block, sector);
+    if (retval != FMP_OK) {
+        if (errorCode)
+            *errorCode = retval;
+        free(block);
+        return NULL;
+    }
     return block;
 }
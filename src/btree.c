@@ -0,0 +1,296 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* In fp3 and fp5 files the chain of level-0 blocks is the bottom of a
+ * B-tree. Block 1 is the root and its level is the height of the tree. An
+ * interior block is a run of chunks whose path and key spell out a
+ * separator, with the block id of the child filed under it as four
+ * big-endian bytes of data. Keys sort by their raw bytes, which may be
+ * strings, so seeks compare bytes rather than path values.
+ *
+ * A child's first key lies between its separator and the next one, but
+ * separators aren't kept exact: keys that have come and gone can leave a
+ * stretch just past a separator that's still filed in the previous child.
+ * So the descent only gets close, and the chain, which is in key order,
+ * settles it: a seek steps back until the block's first chunk is before
+ * the target, or forward while the next block's first chunk isn't past it.
+ *
+ * fp7 and fmp12 files have only level-0 blocks, so there's nothing to
+ * descend and seeks report that the tree can't be used. */
+
+#define SEEK_KEY_MAX 512
+#define SEEK_MAX_STEPS 16
+
+/* Keys are stored as a length byte followed by the bytes of each part */
+typedef struct fmp_seek_key_s {
+    size_t len;
+    uint8_t bytes[SEEK_KEY_MAX];
+} fmp_seek_key_t;
+
+typedef struct fmp_seek_ctx_s {
+    fmp_seek_key_t target;
+    int past;
+    /* The separators on either side of the child being descended into */
+    fmp_seek_key_t low;
+    fmp_seek_key_t high;
+    int has_high;
+    int check_first;
+    size_t child_id;
+    int first_cmp;
+    int bad;
+} fmp_seek_ctx_t;
+
+/* Path values have more than one encoding, since path_value() ignores the
+ * bits that mark a two- or three-byte value. Writes the lowest-sorting
+ * encoding of value, or the highest, and returns its length; 0 if value
+ * can't be encoded. */
+static size_t encode_path_value(uint64_t value, int highest, uint8_t *bytes) {
+    if (value < 0x80) {
+        bytes[0] = value;
+        return 1;
+    }
+    if (value < 0x8080) {
+        bytes[0] = ((value - 0x80) >> 8) | (highest ? 0x80 : 0);
+        bytes[1] = (value - 0x80) & 0xFF;
+        return 2;
+    }
+    if (value >= 0xC000 && value - 0xC000 < 0x400000) {
+        bytes[0] = ((value - 0xC000) >> 16) | (highest ? 0xC0 : 0);
+        bytes[1] = ((value - 0xC000) >> 8) & 0xFF;
+        bytes[2] = (value - 0xC000) & 0xFF;
+        return 3;
+    }
+    return 0;
+}
+
+static int compare_bytes(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp)
+        return cmp < 0 ? -1 : 1;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+static int append_part(fmp_seek_key_t *key, const uint8_t *bytes, size_t len) {
+    if (len > 0xFF || key->len + 1 + len > SEEK_KEY_MAX)
+        return 0;
+    key->bytes[key->len++] = len;
+    memcpy(&key->bytes[key->len], bytes, len);
+    key->len += len;
+    return 1;
+}
+
+/* A chunk's key is its path followed by its own key, if it has one */
+static fmp_data_t entry_key(fmp_chunk_t *chunk, uint8_t *simple_key) {
+    fmp_data_t key = { .bytes = simple_key };
+    if (chunk->type == FMP_CHUNK_FIELD_REF_LONG)
+        return chunk->ref_long;
+    if (chunk->type != FMP_CHUNK_FIELD_REF_SIMPLE)
+        return key;
+    if (chunk->ref_simple > 0xFF)
+        simple_key[key.len++] = chunk->ref_simple >> 8;
+    simple_key[key.len++] = chunk->ref_simple & 0xFF;
+    return key;
+}
+
+static int is_entry(fmp_chunk_t *chunk) {
+    return chunk->type == FMP_CHUNK_FIELD_REF_SIMPLE || chunk->type == FMP_CHUNK_FIELD_REF_LONG;
+}
+
+static int copy_entry(fmp_chunk_t *chunk, fmp_data_t *key, fmp_seek_key_t *dst) {
+    dst->len = 0;
+    for (size_t i=0; i<chunk->path_level; i++) {
+        if (!append_part(dst, chunk->path[i]->bytes, chunk->path[i]->len))
+            return 0;
+    }
+    return append_part(dst, key->bytes, key->len);
+}
+
+#define ENTRY_BEFORE   -1
+#define ENTRY_EQUAL     0
+#define ENTRY_AFTER     1
+#define ENTRY_EXTENDS   2
+
+#define ENTRY_NONE      3
+
+/* An entry that is a prefix of the other key sorts before it; one that
+ * extends the other key is reported as such. */
+static int compare_entry(fmp_chunk_t *chunk, fmp_data_t *key, fmp_seek_key_t *other) {
+    size_t pos = 0;
+    size_t parts = chunk->path_level + is_entry(chunk);
+    for (size_t i=0; i<parts; i++) {
+        if (pos == other->len)
+            return ENTRY_EXTENDS;
+        fmp_data_t *part = i < chunk->path_level ? chunk->path[i] : key;
+        size_t len = other->bytes[pos];
+        int cmp = compare_bytes(part->bytes, part->len, &other->bytes[pos+1], len);
+        if (cmp)
+            return cmp;
+        pos += 1 + len;
+    }
+    return pos < other->len ? ENTRY_BEFORE : ENTRY_EQUAL;
+}
+
+/* A block reached through a separator must start within its range; if not,
+ * the tree is stale and can't be trusted */
+static int first_key_in_range(fmp_chunk_t *chunk, fmp_data_t *key, fmp_seek_ctx_t *ctx) {
+    if (compare_entry(chunk, key, &ctx->low) == ENTRY_BEFORE)
+        return 0;
+    return !ctx->has_high || compare_entry(chunk, key, &ctx->high) == ENTRY_BEFORE;
+}
+
+/* Entries come in key order; the child to take belongs to the last one
+ * that sorts before the target, or the first if none does. When seeking to
+ * where keys start, an entry equal to the target doesn't count, since its
+ * keys might begin in the child before; when seeking past the target,
+ * anything equal to or under it does. */
+static chunk_status_t handle_chunk_seek(fmp_chunk_t *chunk, void *ctxp) {
+    fmp_seek_ctx_t *ctx = (fmp_seek_ctx_t *)ctxp;
+    if (!is_entry(chunk))
+        return CHUNK_NEXT;
+    uint8_t simple_key[2];
+    fmp_data_t key = entry_key(chunk, simple_key);
+    if (chunk->data.len != 4 || (ctx->check_first && !first_key_in_range(chunk, &key, ctx))) {
+        ctx->bad = 1;
+        return CHUNK_DONE;
+    }
+    ctx->check_first = 0;
+    int cmp = compare_entry(chunk, &key, &ctx->target);
+    int before = ctx->past ? (cmp != ENTRY_AFTER) : (cmp == ENTRY_BEFORE);
+    if (before || !ctx->child_id) {
+        const uint8_t *id = chunk->data.bytes;
+        ctx->child_id = ((size_t)id[0] << 24) + (id[1] << 16) + (id[2] << 8) + id[3];
+        ctx->has_high = 0;
+        if (!copy_entry(chunk, &key, &ctx->low) || !ctx->child_id)
+            ctx->bad = 1;
+        return ctx->bad ? CHUNK_DONE : CHUNK_NEXT;
+    }
+    if (!copy_entry(chunk, &key, &ctx->high))
+        ctx->bad = 1;
+    ctx->has_high = 1;
+    return CHUNK_DONE;
+}
+
+/* Compares a level-0 block's first chunk against the target, and checks
+ * its first entry against the separators it was reached through */
+static chunk_status_t handle_chunk_first_item(fmp_chunk_t *chunk, void *ctxp) {
+    fmp_seek_ctx_t *ctx = (fmp_seek_ctx_t *)ctxp;
+    if (chunk->type == FMP_CHUNK_PATH_PUSH || chunk->type == FMP_CHUNK_PATH_POP)
+        return CHUNK_NEXT;
+    uint8_t simple_key[2];
+    fmp_data_t key = entry_key(chunk, simple_key);
+    if (ctx->first_cmp == ENTRY_NONE)
+        ctx->first_cmp = compare_entry(chunk, &key, &ctx->target);
+    if (!ctx->check_first)
+        return CHUNK_DONE;
+    if (!is_entry(chunk))
+        return CHUNK_NEXT;
+    ctx->check_first = 0;
+    ctx->bad = !first_key_in_range(chunk, &key, ctx);
+    return CHUNK_DONE;
+}
+
+static int first_item(fmp_file_t *file, fmp_block_t *block, fmp_seek_ctx_t *ctx) {
+    fmp_chunk_list_t *chunks = NULL;
+    ctx->first_cmp = ENTRY_NONE;
+    if (process_block(file, block, &chunks) != FMP_OK ||
+            process_chunk_list(file, chunks, handle_chunk_first_item, ctx) != FMP_OK || ctx->bad)
+        return 0;
+    return 1;
+}
+
+/* Moves to a neighbouring level-0 block, if the chain agrees both ways */
+static fmp_block_t *step(fmp_file_t *file, fmp_block_t *block, size_t *block_id, int forward) {
+    size_t next_id = forward ? block->next_id : block->prev_id;
+    fmp_error_t retval = FMP_OK;
+    if (next_id == 0 || next_id > file->num_blocks)
+        return NULL;
+    fmp_block_t *next = get_block(file, next_id - 1, &retval);
+    if (!next || next->level != 0 || (size_t)(forward ? next->prev_id : next->next_id) != *block_id)
+        return NULL;
+    *block_id = next_id;
+    return next;
+}
+
+/* Descends from the root to a level-0 block. With past unset, it's the
+ * block where keys at or under path begin; otherwise it's the block where
+ * they end. Walking the chain from one to the other covers everything
+ * filed under path. Returns 0 if the file has no tree or the tree doesn't
+ * hold together, in which case callers walk the whole chain. */
+size_t seek_path(fmp_file_t *file, const uint64_t *path, size_t depth, int past) {
+    fmp_seek_ctx_t ctx = { .past = past };
+    if (file->version_num >= 7)
+        return 0;
+    for (size_t i=0; i<depth; i++) {
+        uint8_t bytes[3];
+        size_t len = encode_path_value(path[i], past, bytes);
+        if (!len || !append_part(&ctx.target, bytes, len))
+            return 0;
+    }
+    fmp_error_t retval = FMP_OK;
+    fmp_block_t *block = get_block(file, 0, &retval);
+    if (!block || block->level <= 0)
+        return 0;
+    size_t block_id = 1;
+    for (int level = block->level; level > 0; level--) {
+        fmp_chunk_list_t *chunks = NULL;
+        if (process_block(file, block, &chunks) != FMP_OK)
+            return 0;
+        ctx.child_id = 0;
+        if (process_chunk_list(file, chunks, handle_chunk_seek, &ctx) != FMP_OK || ctx.bad)
+            return 0;
+        if (ctx.child_id == 0 || ctx.child_id > file->num_blocks)
+            return 0;
+        block = get_block(file, ctx.child_id - 1, &retval);
+        if (!block || block->level != level - 1)
+            return 0;
+        block_id = ctx.child_id;
+        ctx.check_first = 1;
+    }
+
+    if (!first_item(file, block, &ctx))
+        return 0;
+    for (int steps=0; steps<SEEK_MAX_STEPS; steps++) {
+        if (!past) {
+            if (ctx.first_cmp == ENTRY_BEFORE || block->prev_id == 0)
+                return block_id;
+            if (!(block = step(file, block, &block_id, 0)) || !first_item(file, block, &ctx))
+                return 0;
+        } else {
+            if (block->next_id == 0)
+                return block_id;
+            size_t next_id = block_id;
+            fmp_block_t *next = step(file, block, &next_id, 1);
+            if (!next || !first_item(file, next, &ctx))
+                return 0;
+            if (ctx.first_cmp == ENTRY_AFTER)
+                return block_id;
+            block = next;
+            block_id = next_id;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,350 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 600 /* pread, posix_fadvise */
+#define _DEFAULT_SOURCE /* preadv */
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* A fixed number of sectors read on demand with pread(). Slots are kept on a
+ * doubly linked list in order of use; a miss evicts the least recently used
+ * block, throws away its decoded chunks, and reuses its sector buffer.
+ *
+ * With readahead enabled, cache_readahead() claims slots for the next few
+ * sectors in chain order and hands them to readahead.c. Such a slot stays
+ * "reading" until cache_get_block() has waited on it, and is only evicted
+ * as a last resort.
+ *
+ * With a chain order, a miss instead fills the cache with the sectors that
+ * come next in the chain, read in ascending file order with adjacent sectors
+ * merged into single reads. A shuffled file is then read as a series of
+ * forward sweeps rather than one seek per sector. */
+
+typedef struct fmp_cache_slot_s {
+    fmp_block_t block; /* must come first */
+    fmp_read_request_t request;
+    struct fmp_cache_slot_s *prev;
+    struct fmp_cache_slot_s *next;
+    int in_use;
+    int reading;
+    int ready;
+} fmp_cache_slot_t;
+
+struct fmp_cache_s {
+    int fd;
+    size_t capacity;
+    size_t count;
+    size_t readahead_depth;
+    fmp_readahead_t *readahead;
+    uint32_t *chain_pos;
+    fmp_cache_slot_t *mru;
+    fmp_cache_slot_t *lru;
+    uint8_t *sectors;
+    fmp_cache_slot_t slots[];
+};
+
+static void unlink_slot(fmp_cache_t *cache, fmp_cache_slot_t *slot) {
+    if (slot->prev)
+        slot->prev->next = slot->next;
+    else
+        cache->mru = slot->next;
+    if (slot->next)
+        slot->next->prev = slot->prev;
+    else
+        cache->lru = slot->prev;
+    slot->prev = slot->next = NULL;
+}
+
+static void push_slot(fmp_cache_t *cache, fmp_cache_slot_t *slot) {
+    slot->prev = NULL;
+    slot->next = cache->mru;
+    if (cache->mru)
+        cache->mru->prev = slot;
+    cache->mru = slot;
+    if (!cache->lru)
+        cache->lru = slot;
+}
+
+/* Unused slots go to the tail so they are reused first */
+static void push_slot_lru(fmp_cache_t *cache, fmp_cache_slot_t *slot) {
+    slot->next = NULL;
+    slot->prev = cache->lru;
+    if (cache->lru)
+        cache->lru->next = slot;
+    cache->lru = slot;
+    if (!cache->mru)
+        cache->mru = slot;
+}
+
+static void release_slot(fmp_file_t *file, fmp_cache_t *cache, fmp_cache_slot_t *slot) {
+    if (slot->reading) {
+        readahead_wait(cache->readahead, &slot->request);
+        slot->reading = 0;
+    }
+    if (slot->in_use)
+        file->blocks[slot->block.this_id-1] = NULL;
+    slot->in_use = 0;
+    slot->ready = 0;
+}
+
+fmp_cache_t *new_cache(int fd, size_t capacity, size_t sector_size, size_t readahead_depth) {
+    if (capacity < readahead_depth + 2)
+        capacity = readahead_depth + 2;
+    fmp_cache_t *cache = calloc(1, sizeof(fmp_cache_t) + capacity * sizeof(fmp_cache_slot_t));
+    if (!cache)
+        return NULL;
+    cache->sectors = malloc(capacity * sector_size);
+    if (!cache->sectors) {
+        free(cache);
+        return NULL;
+    }
+    if (readahead_depth && !(cache->readahead = new_readahead(fd, readahead_depth))) {
+        free(cache->sectors);
+        free(cache);
+        return NULL;
+    }
+    cache->fd = fd;
+    cache->capacity = capacity;
+    cache->readahead_depth = readahead_depth;
+    for (int i=0; i<capacity; i++) {
+        cache->slots[i].request.buf = &cache->sectors[i * sector_size];
+        cache->slots[i].request.len = sector_size;
+    }
+    return cache;
+}
+
+void free_cache(fmp_file_t *file, fmp_cache_t *cache) {
+    if (cache->readahead)
+        free_readahead(cache->readahead);
+    for (int i=0; i<cache->count; i++) {
+        fmp_cache_slot_t *slot = &cache->slots[i];
+        slot->reading = 0;
+        release_slot(file, cache, slot);
+    }
+    close(cache->fd);
+    free(cache->chain_pos);
+    free(cache->sectors);
+    free(cache);
+}
+
+fmp_error_t cache_use_chain_order(fmp_file_t *file) {
+    fmp_cache_t *cache = file->cache;
+    cache->chain_pos = malloc(file->num_blocks * sizeof(uint32_t));
+    if (!cache->chain_pos)
+        return FMP_ERROR_MALLOC;
+    memset(cache->chain_pos, 0xFF, file->num_blocks * sizeof(uint32_t));
+    for (int i=0; i<file->chain_len; i++) {
+        cache->chain_pos[file->chain_order[i]] = i;
+    }
+    return FMP_OK;
+}
+
+int pread_fully(int fd, uint8_t *buf, size_t len, size_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t count = pread(fd, &buf[done], len - done, offset + done);
+        if (count <= 0)
+            return 0;
+        done += count;
+    }
+    return 1;
+}
+
+/* Find a slot for a new sector, never the one holding block pin_index.
+ * Prefer the least recently used slot that isn't waiting on a read. */
+static fmp_cache_slot_t *take_slot(fmp_file_t *file, fmp_cache_t *cache, size_t pin_index) {
+    fmp_cache_slot_t *slot = NULL;
+    if (cache->count < cache->capacity)
+        return &cache->slots[cache->count++];
+    for (slot = cache->lru; slot; slot = slot->prev) {
+        if (!slot->reading && !(slot->in_use && slot->block.this_id-1 == pin_index))
+            break;
+    }
+    if (!slot) {
+        for (slot = cache->lru; slot; slot = slot->prev) {
+            if (!(slot->in_use && slot->block.this_id-1 == pin_index))
+                break;
+        }
+    }
+    if (slot) {
+        unlink_slot(cache, slot);
+        release_slot(file, cache, slot);
+    }
+    return slot;
+}
+
+static void assign_slot(fmp_file_t *file, fmp_cache_t *cache, fmp_cache_slot_t *slot, size_t index) {
+    memset(&slot->block, 0, sizeof(fmp_block_t));
+    slot->block.this_id = index + 1;
+    slot->request.offset = sector_offset(file, index);
+    slot->in_use = 1;
+    file->blocks[index] = &slot->block;
+    push_slot(cache, slot);
+}
+
+static fmp_error_t finish_slot(fmp_file_t *file, fmp_cache_t *cache, fmp_cache_slot_t *slot) {
+    fmp_error_t retval = FMP_OK;
+    if (slot->reading) {
+        readahead_wait(cache->readahead, &slot->request);
+        slot->reading = 0;
+    }
+    if (slot->request.status != FMP_READ_DONE) {
+        retval = FMP_ERROR_READ;
+    } else {
+        retval = init_block_in_sector(file, &slot->block, slot->request.buf);
+    }
+    if (retval != FMP_OK) {
+        unlink_slot(cache, slot);
+        release_slot(file, cache, slot);
+        push_slot_lru(cache, slot);
+        return retval;
+    }
+    slot->ready = 1;
+    return FMP_OK;
+}
+
+static int compare_index(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+#define MAX_RUN_LEN 64
+
+static void read_run(fmp_file_t *file, fmp_cache_t *cache, fmp_cache_slot_t **run, size_t count) {
+    int ok = 0;
+#ifdef HAVE_PREADV
+    struct iovec iov[MAX_RUN_LEN];
+    for (int i=0; i<count; i++) {
+        iov[i].iov_base = run[i]->request.buf;
+        iov[i].iov_len = run[i]->request.len;
+    }
+    ok = (preadv(cache->fd, iov, count, run[0]->request.offset) == count * file->sector_size);
+#endif
+    for (int i=0; i<count; i++) {
+        if (!ok) {
+            run[i]->request.status = pread_fully(cache->fd, run[i]->request.buf,
+                    run[i]->request.len, run[i]->request.offset) ? FMP_READ_DONE : FMP_READ_FAILED;
+        } else {
+            run[i]->request.status = FMP_READ_DONE;
+        }
+    }
+}
+
+/* Load the missing sectors among the next capacity-1 in chain order,
+ * starting with the one at index, in ascending file order */
+static void fill_window(fmp_file_t *file, fmp_cache_t *cache, size_t index) {
+    fmp_cache_slot_t *run[MAX_RUN_LEN];
+    size_t window = cache->capacity - 1;
+    size_t count = 0, run_len = 0;
+    uint32_t *wanted = malloc((window + 1) * sizeof(uint32_t));
+    if (!wanted)
+        return;
+
+    wanted[count++] = index;
+    for (size_t pos = cache->chain_pos[index] + 1; pos < file->chain_len && count < window; pos++) {
+        if (!file->blocks[file->chain_order[pos]])
+            wanted[count++] = file->chain_order[pos];
+    }
+    qsort(wanted, count, sizeof(uint32_t), &compare_index);
+
+    for (int i=0; i<count; i++) {
+        fmp_cache_slot_t *slot = take_slot(file, cache, index);
+        if (!slot)
+            break;
+        assign_slot(file, cache, slot, wanted[i]);
+        if (run_len && (run_len == MAX_RUN_LEN || wanted[i] != wanted[i-1] + 1)) {
+            read_run(file, cache, run, run_len);
+            run_len = 0;
+        }
+        run[run_len++] = slot;
+    }
+    if (run_len)
+        read_run(file, cache, run, run_len);
+
+    free(wanted);
+}
+
+fmp_block_t *cache_get_block(fmp_file_t *file, size_t index, fmp_error_t *errorCode) {
+    fmp_cache_t *cache = file->cache;
+    fmp_cache_slot_t *slot = (fmp_cache_slot_t *)file->blocks[index];
+    fmp_error_t retval = FMP_OK;
+    if (!slot && cache->chain_pos && cache->chain_pos[index] != UINT32_MAX) {
+        fill_window(file, cache, index);
+        slot = (fmp_cache_slot_t *)file->blocks[index];
+    }
+    if (!slot) {
+        if (!(slot = take_slot(file, cache, index))) {
+            retval = FMP_ERROR_READ;
+            goto cleanup;
+        }
+        assign_slot(file, cache, slot, index);
+        slot->request.status = pread_fully(cache->fd, slot->request.buf,
+                slot->request.len, slot->request.offset) ? FMP_READ_DONE : FMP_READ_FAILED;
+    }
+    if (!slot->ready && (retval = finish_slot(file, cache, slot)) != FMP_OK)
+        goto cleanup;
+
+    unlink_slot(cache, slot);
+    push_slot(cache, slot);
+
+cleanup:
+    if (retval != FMP_OK) {
+        if (errorCode)
+            *errorCode = retval;
+        return NULL;
+    }
+    return &slot->block;
+}
+
+/* Start reads for the sector at index and the ones after it in chain order */
+void cache_readahead(fmp_file_t *file, size_t index) {
+    fmp_cache_t *cache = file->cache;
+    size_t pin_index = index;
+    if (!cache->readahead || !file->sector_next)
+        return;
+    for (int i=0; i<cache->readahead_depth && index < file->num_blocks; i++) {
+        if (!file->blocks[index]) {
+            fmp_cache_slot_t *slot = take_slot(file, cache, pin_index);
+            if (!slot)
+                break;
+            assign_slot(file, cache, slot, index);
+            slot->reading = 1;
+            readahead_submit(cache->readahead, &slot->request);
+        }
+        if (file->sector_next[index] == 0)
+            break;
+        index = file->sector_next[index] - 1;
+    }
+}
+
+void cache_advise_block(fmp_file_t *file, size_t index) {
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(file->cache->fd, sector_offset(file, index), file->sector_size, POSIX_FADV_WILLNEED);
+#endif
+}
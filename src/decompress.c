@@ -0,0 +1,414 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 600 /* pread, fileno, ftello */
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* gzip and zstd input for the stream reader. decoder_read() produces the
+ * uncompressed file front to back. When the compressed input is a regular
+ * file we also drop checkpoints along the way, so decoder_pread() can get
+ * back to an earlier offset by resuming from the nearest checkpoint with a
+ * second cursor instead of decompressing from the top.
+ *
+ * A gzip checkpoint is a copy of the inflate state (about 40K with its
+ * window) taken every CHECKPOINT_SPAN bytes of output, plus one at the
+ * start of every member. zstd has no way to copy a decoder, so checkpoints
+ * only fall on frame boundaries; multi-frame archives such as those written
+ * by pzstd or zstd --seekable get one per frame, and single-frame archives
+ * have the one at the start. */
+
+#define INPUT_CHUNK 65536
+#define CHECKPOINT_SPAN (1 << 20)
+
+typedef enum {
+    DECODER_GZIP,
+    DECODER_ZSTD
+} fmp_decoder_format_t;
+
+typedef struct fmp_checkpoint_s {
+    size_t out_offset;
+    size_t in_offset;
+#ifdef HAVE_ZLIB_H
+    z_stream *zs; /* NULL at the start of a gzip member or zstd frame */
+#endif
+} fmp_checkpoint_t;
+
+typedef struct fmp_cursor_s {
+    size_t out_offset;
+    size_t in_offset; /* compressed bytes fetched so far */
+    size_t input_len;
+    size_t input_pos;
+    int at_boundary;
+    int positioned;
+#ifdef HAVE_ZLIB_H
+    z_stream zs;
+    int zs_init;
+#endif
+#ifdef HAVE_ZSTD_H
+    ZSTD_DStream *zds;
+#endif
+    uint8_t input[INPUT_CHUNK];
+} fmp_cursor_t;
+
+struct fmp_decoder_s {
+    fmp_decoder_format_t format;
+    FILE *stream;
+    int fd;
+    int seekable;
+    size_t base; /* offset of the compressed data in fd */
+    const uint8_t *prefix;
+    size_t prefix_len;
+    size_t num_checkpoints;
+    size_t checkpoints_capacity;
+    fmp_checkpoint_t *checkpoints;
+    fmp_cursor_t frontier;
+    fmp_cursor_t *scratch;
+};
+
+int is_compressed(const uint8_t *magic, size_t len) {
+    if (len >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+        return 1;
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+        return 1;
+    return 0;
+}
+
+static size_t consumed_offset(fmp_cursor_t *cursor) {
+    return cursor->in_offset - (cursor->input_len - cursor->input_pos);
+}
+
+#if defined(HAVE_ZLIB_H) || defined(HAVE_ZSTD_H)
+static int fill_input(fmp_decoder_t *dec, fmp_cursor_t *cursor) {
+    ssize_t count = 0;
+    if (dec->seekable) {
+        count = pread(dec->fd, cursor->input, sizeof(cursor->input), dec->base + cursor->in_offset);
+    } else if (cursor->in_offset < dec->prefix_len) {
+        count = dec->prefix_len - cursor->in_offset;
+        memcpy(cursor->input, &dec->prefix[cursor->in_offset], count);
+    } else {
+        count = fread(cursor->input, 1, sizeof(cursor->input), dec->stream);
+    }
+    if (count <= 0)
+        return 0;
+    cursor->in_offset += count;
+    cursor->input_len = count;
+    cursor->input_pos = 0;
+    return 1;
+}
+#endif
+
+static int add_checkpoint(fmp_decoder_t *dec, fmp_cursor_t *cursor, int copy_state) {
+    if (dec->num_checkpoints == dec->checkpoints_capacity) {
+        size_t capacity = dec->checkpoints_capacity ? 2 * dec->checkpoints_capacity : 16;
+        fmp_checkpoint_t *checkpoints = realloc(dec->checkpoints, capacity * sizeof(fmp_checkpoint_t));
+        if (!checkpoints)
+            return 0;
+        dec->checkpoints = checkpoints;
+        dec->checkpoints_capacity = capacity;
+    }
+    fmp_checkpoint_t *checkpoint = &dec->checkpoints[dec->num_checkpoints];
+    checkpoint->out_offset = cursor->out_offset;
+    checkpoint->in_offset = consumed_offset(cursor);
+#ifdef HAVE_ZLIB_H
+    checkpoint->zs = NULL;
+    if (copy_state) {
+        if (!(checkpoint->zs = calloc(1, sizeof(z_stream))))
+            return 0;
+        if (inflateCopy(checkpoint->zs, &cursor->zs) != Z_OK) {
+            free(checkpoint->zs);
+            return 0;
+        }
+    }
+#endif
+    dec->num_checkpoints++;
+    return 1;
+}
+
+static int init_cursor(fmp_decoder_t *dec, fmp_cursor_t *cursor) {
+    cursor->at_boundary = 1;
+    cursor->positioned = 1;
+#ifdef HAVE_ZLIB_H
+    if (dec->format == DECODER_GZIP) {
+        if (inflateInit2(&cursor->zs, 15 + 16) != Z_OK)
+            return 0;
+        cursor->zs_init = 1;
+    }
+#endif
+#ifdef HAVE_ZSTD_H
+    if (dec->format == DECODER_ZSTD && !(cursor->zds = ZSTD_createDStream()))
+        return 0;
+#endif
+    return 1;
+}
+
+static void free_cursor(fmp_cursor_t *cursor) {
+#ifdef HAVE_ZLIB_H
+    if (cursor->zs_init)
+        inflateEnd(&cursor->zs);
+#endif
+#ifdef HAVE_ZSTD_H
+    if (cursor->zds)
+        ZSTD_freeDStream(cursor->zds);
+#endif
+}
+
+#ifdef HAVE_ZLIB_H
+/* Concatenated members are decoded as one stream, as gunzip does. Anything
+ * that fails to decode as the start of a new member ends the input. */
+static size_t inflate_into(fmp_decoder_t *dec, fmp_cursor_t *cursor,
+        uint8_t *out, size_t len, int is_frontier) {
+    size_t done = 0;
+    while (done < len) {
+        if (cursor->input_pos == cursor->input_len && !fill_input(dec, cursor))
+            break;
+        int member_start = cursor->at_boundary;
+        if (cursor->at_boundary) {
+            if (is_frontier && dec->seekable && consumed_offset(cursor) > 0 &&
+                    !add_checkpoint(dec, cursor, 0))
+                break;
+            inflateReset(&cursor->zs);
+            cursor->at_boundary = 0;
+        }
+        cursor->zs.next_in = &cursor->input[cursor->input_pos];
+        cursor->zs.avail_in = cursor->input_len - cursor->input_pos;
+        cursor->zs.next_out = &out[done];
+        cursor->zs.avail_out = len - done;
+        int status = inflate(&cursor->zs, Z_NO_FLUSH);
+        size_t produced = (len - done) - cursor->zs.avail_out;
+        cursor->input_pos = cursor->input_len - cursor->zs.avail_in;
+        cursor->out_offset += produced;
+        done += produced;
+        if (status == Z_STREAM_END) {
+            cursor->at_boundary = 1;
+        } else if (status != Z_OK && status != Z_BUF_ERROR) {
+            if (!member_start)
+                cursor->positioned = 0;
+            break;
+        }
+        if (is_frontier && dec->seekable && !cursor->at_boundary &&
+                cursor->out_offset >= dec->checkpoints[dec->num_checkpoints-1].out_offset + CHECKPOINT_SPAN &&
+                !add_checkpoint(dec, cursor, 1))
+            break;
+    }
+    return done;
+}
+#endif
+
+#ifdef HAVE_ZSTD_H
+static size_t zstd_into(fmp_decoder_t *dec, fmp_cursor_t *cursor,
+        uint8_t *out, size_t len, int is_frontier) {
+    size_t done = 0;
+    while (done < len) {
+        if (cursor->input_pos == cursor->input_len && !fill_input(dec, cursor))
+            break;
+        if (cursor->at_boundary) {
+            if (is_frontier && dec->seekable && consumed_offset(cursor) > 0 &&
+                    !add_checkpoint(dec, cursor, 0))
+                break;
+            cursor->at_boundary = 0;
+        }
+        ZSTD_inBuffer in = { cursor->input, cursor->input_len, cursor->input_pos };
+        ZSTD_outBuffer output = { out, len, done };
+        size_t status = ZSTD_decompressStream(cursor->zds, &output, &in);
+        if (ZSTD_isError(status)) {
+            cursor->positioned = 0;
+            break;
+        }
+        cursor->input_pos = in.pos;
+        cursor->out_offset += output.pos - done;
+        done = output.pos;
+        if (status == 0)
+            cursor->at_boundary = 1;
+    }
+    return done;
+}
+#endif
+
+static size_t decode_into(fmp_decoder_t *dec, fmp_cursor_t *cursor,
+        uint8_t *out, size_t len, int is_frontier) {
+    if (!cursor->positioned)
+        return 0;
+#ifdef HAVE_ZLIB_H
+    if (dec->format == DECODER_GZIP)
+        return inflate_into(dec, cursor, out, len, is_frontier);
+#endif
+#ifdef HAVE_ZSTD_H
+    if (dec->format == DECODER_ZSTD)
+        return zstd_into(dec, cursor, out, len, is_frontier);
+#endif
+    return 0;
+}
+
+/* The prefix holds bytes already taken from stream to sniff the format */
+fmp_decoder_t *new_decoder(FILE *stream, const uint8_t *prefix, size_t prefix_len,
+        fmp_error_t *errorCode) {
+    fmp_error_t retval = FMP_OK;
+    struct stat st;
+    fmp_decoder_t *dec = calloc(1, sizeof(fmp_decoder_t));
+    if (!dec) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    dec->format = prefix[0] == 0x1F ? DECODER_GZIP : DECODER_ZSTD;
+#ifndef HAVE_ZLIB_H
+    if (dec->format == DECODER_GZIP) {
+        retval = FMP_ERROR_NO_DECOMPRESSOR;
+        goto cleanup;
+    }
+#endif
+#ifndef HAVE_ZSTD_H
+    if (dec->format == DECODER_ZSTD) {
+        retval = FMP_ERROR_NO_DECOMPRESSOR;
+        goto cleanup;
+    }
+#endif
+    dec->stream = stream;
+    dec->fd = fileno(stream);
+    dec->prefix = prefix;
+    dec->prefix_len = prefix_len;
+    off_t position = ftello(stream);
+    if (fstat(dec->fd, &st) == 0 && S_ISREG(st.st_mode) && position >= (off_t)prefix_len) {
+        dec->seekable = 1;
+        dec->base = position - prefix_len;
+    }
+    if (!init_cursor(dec, &dec->frontier)) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    if (dec->seekable && !add_checkpoint(dec, &dec->frontier, 0))
+        retval = FMP_ERROR_MALLOC;
+
+cleanup:
+    if (retval != FMP_OK) {
+        if (dec)
+            free_decoder(dec);
+        if (errorCode)
+            *errorCode = retval;
+        return NULL;
+    }
+    return dec;
+}
+
+size_t decoder_read(fmp_decoder_t *dec, uint8_t *buf, size_t len) {
+    return decode_into(dec, &dec->frontier, buf, len, 1);
+}
+
+int decoder_can_seek(fmp_decoder_t *dec) {
+    return dec->seekable;
+}
+
+static int restore_checkpoint(fmp_decoder_t *dec, fmp_cursor_t *cursor, fmp_checkpoint_t *checkpoint) {
+    cursor->out_offset = checkpoint->out_offset;
+    cursor->in_offset = checkpoint->in_offset;
+    cursor->input_len = cursor->input_pos = 0;
+    cursor->at_boundary = 1;
+    cursor->positioned = 1;
+#ifdef HAVE_ZLIB_H
+    if (dec->format == DECODER_GZIP && (checkpoint->zs || !cursor->zs_init)) {
+        if (cursor->zs_init)
+            inflateEnd(&cursor->zs);
+        cursor->zs_init = 0;
+        if (checkpoint->zs ? inflateCopy(&cursor->zs, checkpoint->zs) : inflateInit2(&cursor->zs, 15 + 16))
+            return 0;
+        cursor->zs_init = 1;
+        cursor->at_boundary = !checkpoint->zs;
+    }
+#endif
+#ifdef HAVE_ZSTD_H
+    if (cursor->zds)
+        ZSTD_DCtx_reset(cursor->zds, ZSTD_reset_session_only);
+#endif
+    return 1;
+}
+
+/* Reads that move forward keep going from where the last one stopped, as
+ * long as no later checkpoint would be closer. */
+fmp_error_t decoder_pread(fmp_decoder_t *dec, uint8_t *buf, size_t len, size_t offset) {
+    uint8_t discard[4096];
+    fmp_cursor_t *cursor = dec->scratch;
+    if (!dec->seekable)
+        return FMP_ERROR_SEEK;
+    if (!cursor) {
+        if (!(cursor = dec->scratch = calloc(1, sizeof(fmp_cursor_t))))
+            return FMP_ERROR_MALLOC;
+        if (!init_cursor(dec, cursor))
+            return FMP_ERROR_MALLOC;
+        cursor->positioned = 0;
+    }
+    size_t lo = 0, hi = dec->num_checkpoints;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (dec->checkpoints[mid].out_offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    fmp_checkpoint_t *checkpoint = &dec->checkpoints[lo];
+    if (!cursor->positioned || cursor->out_offset > offset || cursor->out_offset < checkpoint->out_offset) {
+        if (!restore_checkpoint(dec, cursor, checkpoint)) {
+            cursor->positioned = 0;
+            return FMP_ERROR_MALLOC;
+        }
+    }
+    while (cursor->out_offset < offset) {
+        size_t skip = offset - cursor->out_offset;
+        if (skip > sizeof(discard))
+            skip = sizeof(discard);
+        if (decode_into(dec, cursor, discard, skip, 0) != skip)
+            return FMP_ERROR_READ;
+    }
+    if (decode_into(dec, cursor, buf, len, 0) != len)
+        return FMP_ERROR_READ;
+    return FMP_OK;
+}
+
+void free_decoder(fmp_decoder_t *dec) {
+    free_cursor(&dec->frontier);
+    if (dec->scratch) {
+        free_cursor(dec->scratch);
+        free(dec->scratch);
+    }
+#ifdef HAVE_ZLIB_H
+    for (size_t i=0; i<dec->num_checkpoints; i++) {
+        if (dec->checkpoints[i].zs) {
+            inflateEnd(dec->checkpoints[i].zs);
+            free(dec->checkpoints[i].zs);
+        }
+    }
+#endif
+    free(dec->checkpoints);
+    free(dec);
+}
@@ -0,0 +1,150 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* In fp7 and fmp12 files each table lives under its own root path,
+ * [128+X]. Its columns under [128+X].[3] and its records under [128+X].[5]
+ * sit in one stretch of blocks, but other parts of the table, like the
+ * metadata under [128+X].[7], can turn up again near the end of the chain,
+ * after later tables. The directory records, for each root value, the
+ * first and last block on the chain where a handler sees that root, and
+ * their places along the chain, and for table roots counts only chunks
+ * under [3] and [5], which are all that table reads look at. It's built
+ * with one scan the first time a table is read; after that, per-table
+ * scans walk only their own stretch of the chain. */
+
+typedef struct fmp_directory_ctx_s {
+    fmp_directory_t *directory;
+    size_t block_id;
+    size_t position;
+    chunk_handler handle_chunk;
+    void *user_ctx;
+} fmp_directory_ctx_t;
+
+static int handle_block_directory(fmp_block_t *block, void *ctxp) {
+    fmp_directory_ctx_t *ctx = (fmp_directory_ctx_t *)ctxp;
+    ctx->block_id = block->this_id;
+    ctx->position++;
+    return 1;
+}
+
+/* Widens the root's range to take in block_id, the position'th block on
+ * the chain; 0 if out of memory */
+static int note_root(fmp_directory_t *directory, uint64_t root, size_t block_id, size_t position) {
+    if (root >= directory->count) {
+        size_t count = root + 1;
+        fmp_block_range_t *roots = realloc(directory->roots, count * sizeof(fmp_block_range_t));
+        if (!roots)
+            return 0;
+        memset(&roots[directory->count], 0, (count - directory->count) * sizeof(fmp_block_range_t));
+        directory->roots = roots;
+        directory->count = count;
+    }
+    fmp_block_range_t *range = &directory->roots[root];
+    if (!range->first_id) {
+        range->first_id = block_id;
+        range->first_pos = position;
+    }
+    range->last_id = block_id;
+    range->last_pos = position;
+    return 1;
+}
+
+/* Records the root that table handlers compare against, which is whatever
+ * is at the bottom of the path stack, including right after a pop. */
+static chunk_status_t handle_chunk_directory(fmp_chunk_t *chunk, void *ctxp) {
+    fmp_directory_ctx_t *ctx = (fmp_directory_ctx_t *)ctxp;
+    uint64_t root = chunk->path_values[0];
+    if ((root < 128 || path_is_table_part(chunk)) &&
+            !note_root(ctx->directory, root, ctx->block_id, ctx->position))
+        return CHUNK_ABORT;
+    if (ctx->handle_chunk)
+        return ctx->handle_chunk(chunk, ctx->user_ctx);
+    return CHUNK_NEXT;
+}
+
+/* Builds the file's directory, passing every chunk on to handle_chunk, if
+ * given, so that other whole-file work can share the scan */
+fmp_error_t build_directory(fmp_file_t *file, chunk_handler handle_chunk, void *user_ctx) {
+    fmp_directory_t *directory = calloc(1, sizeof(fmp_directory_t));
+    if (!directory)
+        return FMP_ERROR_MALLOC;
+    fmp_directory_ctx_t ctx = { .directory = directory,
+        .handle_chunk = handle_chunk, .user_ctx = user_ctx };
+    fmp_error_t retval = process_blocks(file, handle_block_directory, handle_chunk_directory, &ctx);
+    directory->valid = (retval == FMP_OK);
+    file->directory = directory;
+    return retval;
+}
+
+void free_directory(fmp_directory_t *directory) {
+    if (directory) {
+        free(directory->roots);
+        free(directory);
+    }
+}
+
+/* fp3 and fp5 files hold one table, with its columns under [3] and its
+ * records under [5], so the B-tree gives the stretch of chain to walk. */
+static fmp_error_t process_table_blocks_v3(fmp_file_t *file, size_t first_id,
+        block_handler handle_block, chunk_handler handle_chunk, void *user_ctx) {
+    uint64_t first_path[] = { 3 };
+    uint64_t last_path[] = { 5 };
+    size_t start_id = seek_path(file, first_path, 1, 0);
+    size_t last_id = seek_path(file, last_path, 1, 1);
+    if (!start_id || !last_id)
+        return process_block_range(file, first_id ? first_id : 2, 0, handle_block, handle_chunk, user_ctx);
+    return process_block_range(file, first_id ? first_id : start_id, last_id,
+            handle_block, handle_chunk, user_ctx);
+}
+
+/* Scans only the blocks that can hold chunks under [128+table_index],
+ * starting at block first_id, which must be one of them, or at the first
+ * of them if it's 0. A table that doesn't appear anywhere scans nothing.
+ * Files whose directory couldn't be built get a full scan. */
+fmp_error_t process_table_blocks_from(fmp_file_t *file, size_t table_index, size_t first_id,
+        block_handler handle_block, chunk_handler handle_chunk, void *user_ctx) {
+    if (file->version_num < 7)
+        return process_table_blocks_v3(file, first_id, handle_block, handle_chunk, user_ctx);
+    if (!file->directory)
+        build_directory(file, NULL, NULL);
+    if (!file->directory)
+        return FMP_ERROR_MALLOC;
+    fmp_directory_t *directory = file->directory;
+    if (!directory->valid)
+        return process_block_range(file, first_id ? first_id : 2, 0, handle_block, handle_chunk, user_ctx);
+    size_t root = table_index + 128;
+    if (root >= directory->count || !directory->roots[root].first_id)
+        return FMP_OK;
+    return process_block_range(file, first_id ? first_id : directory->roots[root].first_id,
+            directory->roots[root].last_id, handle_block, handle_chunk, user_ctx);
+}
+
+fmp_error_t process_table_blocks(fmp_file_t *file, size_t table_index,
+        chunk_handler handle_chunk, void *user_ctx) {
+    return process_table_blocks_from(file, table_index, 0, NULL, handle_chunk, user_ctx);
+}
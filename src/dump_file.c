@@ -51,8 +51,11 @@ static void dump_data(fmp_chunk_t *chunk, fmp_data_t *data, fmp_dump_ctx_t *ctx)
     } else {
         size_t utf8_len = 4*len+1;
         char *utf8 = malloc(utf8_len);
-        convert(ctx->converter, ctx->xor_mask, utf8, utf8_len, bytes, len);
+        uint8_t *unmasked = malloc(len);
+        unmask_bytes(unmasked, bytes, len, ctx->xor_mask);
+        convert(ctx->converter, utf8, utf8_len, unmasked, len);
         printf("\"%s\"", utf8);
+        free(unmasked);
         free(utf8);
     }
 }
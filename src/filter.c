@@ -0,0 +1,141 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* Filters are lists of conditions on columns, all of which a row must meet
+ * for fmp_read_values_where to hand it over. Conditions are checked
+ * against values as stored, after unmasking but before any conversion, so
+ * their operands are bytes in the file's character set. Printable ASCII is
+ * stored as itself in every character set FileMaker uses, but line breaks
+ * are stored as CR, which value handlers see as LF in fp7 and fmp12 files,
+ * so LFs in operands are taken to mean CR. As in the strings handed to
+ * value handlers, leading spaces aren't counted. */
+
+fmp_filter_t *fmp_new_filter(fmp_error_t *errorCode) {
+    fmp_filter_t *filter = calloc(1, sizeof(fmp_filter_t));
+    if (errorCode)
+        *errorCode = filter ? FMP_OK : FMP_ERROR_MALLOC;
+    return filter;
+}
+
+static fmp_error_t copy_operand(fmp_data_t *dst, const void *bytes, size_t len) {
+    if (!bytes)
+        return FMP_OK;
+    uint8_t *copy = malloc(len ? len : 1);
+    if (!copy)
+        return FMP_ERROR_MALLOC;
+    memcpy(copy, bytes, len);
+    for (size_t i=0; i<len; i++) {
+        if (copy[i] == '\n')
+            copy[i] = '\r';
+    }
+    dst->bytes = copy;
+    dst->len = len;
+    return FMP_OK;
+}
+
+static fmp_error_t add_condition(fmp_filter_t *filter, fmp_column_t *column, fmp_filter_op_t op,
+        const void *bytes, size_t len, const void *max, size_t max_len) {
+    fmp_condition_t condition = { .column_index = column->index, .op = op };
+    fmp_error_t retval = FMP_OK;
+    if ((retval = copy_operand(&condition.operand, bytes, len)) != FMP_OK ||
+            (retval = copy_operand(&condition.max, max, max_len)) != FMP_OK)
+        goto error;
+    fmp_condition_t *conditions = realloc(filter->conditions,
+            (filter->count + 1) * sizeof(fmp_condition_t));
+    if (!conditions) {
+        retval = FMP_ERROR_MALLOC;
+        goto error;
+    }
+    filter->conditions = conditions;
+    filter->conditions[filter->count++] = condition;
+    return FMP_OK;
+
+error:
+    free(condition.operand.bytes);
+    free(condition.max.bytes);
+    return retval;
+}
+
+fmp_error_t fmp_filter_equals(fmp_filter_t *filter, fmp_column_t *column, const void *bytes, size_t len) {
+    return add_condition(filter, column, FMP_FILTER_EQUALS, bytes ? bytes : "", bytes ? len : 0, NULL, 0);
+}
+
+fmp_error_t fmp_filter_prefix(fmp_filter_t *filter, fmp_column_t *column, const void *bytes, size_t len) {
+    return add_condition(filter, column, FMP_FILTER_PREFIX, bytes ? bytes : "", bytes ? len : 0, NULL, 0);
+}
+
+/* Either bound may be NULL, leaving that end open */
+fmp_error_t fmp_filter_range(fmp_filter_t *filter, fmp_column_t *column,
+        const void *min, size_t min_len, const void *max, size_t max_len) {
+    return add_condition(filter, column, FMP_FILTER_RANGE, min, min_len, max, max_len);
+}
+
+fmp_error_t fmp_filter_not_empty(fmp_filter_t *filter, fmp_column_t *column) {
+    return add_condition(filter, column, FMP_FILTER_NOT_EMPTY, NULL, 0, NULL, 0);
+}
+
+static int compare_bytes(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp)
+        return cmp;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/* A column with no value in a row is checked as if it held "" */
+int condition_matches(fmp_condition_t *condition, const uint8_t *bytes, size_t len) {
+    while (len && bytes[0] == ' ') {
+        bytes++;
+        len--;
+    }
+    fmp_data_t *operand = &condition->operand;
+    switch (condition->op) {
+        case FMP_FILTER_EQUALS:
+            return len == operand->len && memcmp(bytes, operand->bytes, len) == 0;
+        case FMP_FILTER_PREFIX:
+            return len >= operand->len && memcmp(bytes, operand->bytes, operand->len) == 0;
+        case FMP_FILTER_RANGE:
+            if (operand->bytes && compare_bytes(bytes, len, operand->bytes, operand->len) < 0)
+                return 0;
+            return !condition->max.bytes ||
+                compare_bytes(bytes, len, condition->max.bytes, condition->max.len) <= 0;
+        case FMP_FILTER_NOT_EMPTY:
+            return len > 0;
+    }
+    return 0;
+}
+
+void fmp_free_filter(fmp_filter_t *filter) {
+    if (filter) {
+        for (size_t i=0; i<filter->count; i++) {
+            free(filter->conditions[i].operand.bytes);
+            free(filter->conditions[i].max.bytes);
+        }
+        free(filter->conditions);
+        free(filter);
+    }
+}
@@ -21,15 +21,21 @@
  */
 
 #define _XOPEN_SOURCE 600 /* strptime */
-#define _POSIX_C_SOURCE 200809L /* fmemopen */
+#define _POSIX_C_SOURCE 200809L /* strdup */
+#define _DEFAULT_SOURCE /* madvise */
 #include <time.h>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <iconv.h>
 #include <stdarg.h>
 #include <libgen.h>
@@ -75,12 +81,7 @@ void debug(const char *fmt, ...) {
     va_end(argp);
 }
 
-fmp_error_t read_header(fmp_file_t *ctx) {
-    char buf[1024];
-
-    if (!fread(buf, sizeof(buf), 1, ctx->stream))
-        return FMP_ERROR_READ;
-
+fmp_error_t read_header(fmp_file_t *ctx, const char *buf) {
     if (memcmp(buf, MAGICK, sizeof(MAGICK)-1)) {
         return FMP_ERROR_BAD_MAGIC_NUMBER;
     }
@@ -115,16 +116,67 @@ fmp_error_t read_header(fmp_file_t *ctx) {
 #endif
     copy_pascal_string(ctx->version_string, sizeof(ctx->version_string), &buf[541]);
 
-    // Throwaway sector
-    if (ctx->sector_size == 1024) {
-        fseek(ctx->stream, 2 * ctx->sector_size, SEEK_SET);
+    return FMP_OK;
+}
+
+/* Byte offset of the sector backing file->blocks[index]. In fp5 the
+ * sector after the header is a throwaway. */
+size_t sector_offset(fmp_file_t *file, size_t index) {
+    return (index + 1 + (file->version_num < 7)) * file->sector_size;
+}
+
+static void advise_block(fmp_file_t *file, size_t index, int willneed) {
+    if (index >= file->num_blocks)
+        return;
+    if (file->cache && willneed)
+        cache_advise_block(file, index);
+#ifdef HAVE_MADVISE
+    if (!file->mapped)
+        return;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = sector_offset(file, index);
+    size_t end = start + file->sector_size;
+    if (willneed) {
+        start -= start % page_size;
+        end += (page_size - end % page_size) % page_size;
+        if (end > file->map_len)
+            end = file->map_len;
+        madvise((void *)(file->map + start), end - start, MADV_WILLNEED);
     } else {
-        fseek(ctx->stream, ctx->sector_size, SEEK_SET);
+        /* Only drop pages that lie entirely within the sector */
+        start += (page_size - start % page_size) % page_size;
+        end -= end % page_size;
+        if (start < end)
+            madvise((void *)(file->map + start), end - start, MADV_DONTNEED);
     }
+#endif
+}
 
+/* Extends blocks[] to count entries, clearing the new ones */
+fmp_error_t grow_blocks(fmp_file_t *file, size_t count) {
+    if (count <= file->blocks_allocated)
+        return FMP_OK;
+    fmp_block_t **blocks = realloc(file->blocks, count * sizeof(fmp_block_t *));
+    if (!blocks)
+        return FMP_ERROR_MALLOC;
+    memset(&blocks[file->blocks_allocated], 0, (count - file->blocks_allocated) * sizeof(fmp_block_t *));
+    file->blocks = blocks;
+    file->blocks_allocated = count;
     return FMP_OK;
 }
 
+fmp_block_t *get_block(fmp_file_t *file, size_t index, fmp_error_t *errorCode) {
+    if (index >= file->num_blocks)
+        return NULL;
+    if (file->stream_source)
+        return stream_get_block(file, index, errorCode);
+    if (file->cache)
+        return cache_get_block(file, index, errorCode);
+    if (!file->blocks[index] && file->map)
+        file->blocks[index] = new_block_in_sector(file, file->map + sector_offset(file, index), errorCode);
+    return file->blocks[index];
+}
+
 uint64_t path_value(fmp_chunk_t *chunk, fmp_data_t *path) {
     if (!path)
         return 0;
@@ -144,17 +196,10 @@ int path_is(fmp_chunk_t *chunk, fmp_data_t *path, uint64_t value) {
     return path_value(chunk, path) == value;
 }
 
-void convert(iconv_t converter, uint8_t xor_mask,
+void convert(iconv_t converter,
         char *dst, size_t dst_len, uint8_t *src, size_t src_len) {
     char *input_bytes = (char *)src;
     size_t input_bytes_left = src_len;
-    if (xor_mask) {
-        input_bytes = malloc(input_bytes_left);
-        for (int i=0; i<input_bytes_left; i++) {
-            input_bytes[i] = xor_mask ^ src[i];
-        }
-        src = (uint8_t *)input_bytes;
-    }
     while (input_bytes_left && input_bytes[0] == ' ') {
         input_bytes++;
         input_bytes_left--;
@@ -171,9 +216,6 @@ void convert(iconv_t converter, uint8_t xor_mask,
     } else if (dst_len) {
         dst[dst_len-1] = '\0';
     }
-    if (xor_mask) {
-        free(src);
-    }
 }
 
 int table_path_depth(fmp_chunk_t *chunk) {
@@ -182,26 +224,55 @@ int table_path_depth(fmp_chunk_t *chunk) {
     return chunk->path_level - 1;
 }
 
+/* Whether an fp7 or fmp12 chunk is under [128+X].[3] or [128+X].[5], a
+ * table's columns and records, which are all that table reads look at */
+int path_is_table_part(fmp_chunk_t *chunk) {
+    return chunk->path_values[0] >= 128 && chunk->path_level >= 2 &&
+        (chunk->path_values[1] == 3 || chunk->path_values[1] == 5);
+}
+
 int table_path_match_start1(fmp_chunk_t *chunk, int depth, int val) {
     if (table_path_depth(chunk) != depth)
         return 0;
     if (chunk->version_num < 7)
-        return path_is(chunk, chunk->path[0], val);
-    return path_value(chunk, chunk->path[0]) >= 128 && path_is(chunk, chunk->path[1], val);
+        return chunk->path_values[0] == val;
+    return chunk->path_values[0] >= 128 && chunk->path_values[1] == val;
 }
 
 int table_path_match_start2(fmp_chunk_t *chunk, int depth, int val1, int val2) {
     if (table_path_depth(chunk) != depth)
         return 0;
     if (chunk->version_num < 7)
-        return path_is(chunk, chunk->path[0], val1) && path_is(chunk, chunk->path[1], val2);
-    return (path_value(chunk, chunk->path[0]) >= 128 &&
-            path_is(chunk, chunk->path[1], val1) && path_is(chunk, chunk->path[2], val2));
+        return chunk->path_values[0] == val1 && chunk->path_values[1] == val2;
+    return (chunk->path_values[0] >= 128 &&
+            chunk->path_values[1] == val1 && chunk->path_values[2] == val2);
 }
 
+/* Fills in a view of the i'th chunk; its data points into the payload */
+static void get_chunk(fmp_chunk_list_t *list, size_t i, fmp_chunk_t *chunk) {
+    chunk->type = list->type[i];
+    chunk->code = list->code[i];
+    chunk->extended = list->flags[i] & CHUNK_EXTENDED;
+    chunk->data.bytes = list->payload + list->data_offset[i];
+    chunk->data.len = list->data_len[i];
+    chunk->ref_long.bytes = list->payload + list->ref_long_offset[i];
+    chunk->ref_long.len = list->ref_long_len[i];
+    if (chunk->type == FMP_CHUNK_DATA_SEGMENT) {
+        chunk->segment_index = list->key[i];
+        chunk->ref_simple = 0;
+    } else {
+        chunk->segment_index = 0;
+        chunk->ref_simple = list->key[i];
+    }
+}
+
+/* Chunks are views over the chunk list, so pushed path entries are copied
+ * into path_data, with path[] pointing at the copies. Each entry's integer
+ * value is decoded once here, so handlers can compare path_values[]. */
 chunk_status_t process_chunk(fmp_file_t *file, fmp_chunk_t *chunk,
         chunk_handler handle_chunk, void *user_ctx) {
     chunk->path = file->path;
+    chunk->path_values = file->path_values;
     chunk->path_level = file->path_level;
     chunk->version_num = file->version_num;
     if (chunk->type == FMP_CHUNK_PATH_POP) {
@@ -209,67 +280,96 @@ chunk_status_t process_chunk(fmp_file_t *file, fmp_chunk_t *chunk,
             file->path_level--;
     }
     if (chunk->type == FMP_CHUNK_PATH_PUSH) {
-        if (file->path_level + 1 > file->path_capacity)
-            file->path = realloc(file->path, (file->path_capacity *= 2) * sizeof(fmp_data_t *));
-        file->path[file->path_level++] = &chunk->data;
+        size_t level = file->path_level++;
+        file->path_data[level] = chunk->data;
+        file->path[level] = &file->path_data[level];
+        file->path_values[level] = path_value(chunk, &chunk->data);
     }
     return handle_chunk(chunk, user_ctx);
 }
 
-fmp_error_t process_chunk_chain(fmp_file_t *file, fmp_chunk_t *chunk,
+fmp_error_t process_chunk_list(fmp_file_t *file, fmp_chunk_list_t *list,
         chunk_handler handle_chunk, void *user_ctx) {
+    /* Don't leave handlers looking at pushes from a block that may be gone */
     file->path_level = 0;
-    while (chunk) {
-        chunk_status_t status = process_chunk(file, chunk, handle_chunk, user_ctx);
+    memset(file->path, 0, sizeof(file->path));
+    memset(file->path_values, 0, sizeof(file->path_values));
+    size_t i = 0;
+    while (list && i < list->count) {
+        fmp_chunk_t chunk;
+        get_chunk(list, i, &chunk);
+        if (chunk.type == FMP_CHUNK_PATH_PUSH && file->path_level == FMP_MAX_PATH_DEPTH)
+            return FMP_ERROR_BAD_SECTOR;
+        chunk_status_t status = process_chunk(file, &chunk, handle_chunk, user_ctx);
         if (status == CHUNK_ABORT)
             return FMP_ERROR_USER_ABORTED;
         if (status == CHUNK_DONE)
             break;
+        if (status == CHUNK_STOP) {
+            file->scan_stopped = 1;
+            break;
+        }
         if (status == CHUNK_NEXT)
-            chunk = chunk->next;
+            i++;
     }
     return FMP_OK;
 }
 
-void free_chunk_chain(fmp_block_t *block) {
-    fmp_chunk_t *chunk = block->chunk;
-    while (chunk) {
-        fmp_chunk_t *next = chunk->next;
-        free(chunk);
-        chunk = next;
-    }
-    block->chunk = NULL;
-}
-
-fmp_error_t process_blocks(fmp_file_t *file,
+/* Walks the chain from block first_id through block last_id, or to the end
+ * of the chain if last_id is 0, or until a handler returns CHUNK_STOP */
+fmp_error_t process_block_range(fmp_file_t *file, size_t first_id, size_t last_id,
         block_handler handle_block,
         chunk_handler handle_chunk,
         void *user_ctx) {
     fmp_error_t retval = FMP_OK;
+    fmp_chunk_list_t *chunks = NULL;
     /*
     fmp_block_t *block = file->blocks[0];
-    process_block(file, block);
+    process_block(file, block, &chunks);
     if (!handle_block || handle_block(block, user_ctx))
-        process_chunk_chain(file, block->chunk, handle_chunk, user_ctx);
+        process_chunk_list(file, chunks, handle_chunk, user_ctx);
         */
-    int next_block = 2;
+    if (first_id == 0 || first_id > file->num_blocks)
+        return FMP_ERROR_BAD_SECTOR;
+    int next_block = first_id;
+    int prev_block = 0;
     int *blocks_visited = calloc(file->num_blocks, sizeof(int));
+    file->scan_linked = (first_id == 2);
+    file->scan_stopped = 0;
     do {
-        fmp_block_t *block = file->blocks[next_block-1];
-        retval = process_block(file, block);
+        if (file->cache)
+            cache_readahead(file, next_block-1);
+        if (file->sector_next)
+            advise_block(file, file->sector_next[next_block-1]-1, 1);
+        fmp_block_t *block = get_block(file, next_block-1, &retval);
+        if (!block) {
+            /* Keep the read or allocation error get_block reported */
+            if (retval == FMP_OK)
+                retval = FMP_ERROR_BAD_SECTOR;
+            break;
+        }
+        if (!file->sector_next)
+            advise_block(file, block->next_id-1, 1);
+        retval = process_block(file, block, &chunks);
         blocks_visited[next_block-1] = 1;
         if (retval != FMP_OK) {
             /*
             fprintf(stderr, "ERROR processing block, reporting partial results...\n");
             block->this_id = next_block;
             if (!handle_block || handle_block(block, user_ctx))
-                process_chunk_chain(file, block->chunk, handle_chunk, user_ctx);
+                process_chunk_list(file, chunks, handle_chunk, user_ctx);
                 */
             break;
         }
         block->this_id = next_block;
+        if (prev_block && block->prev_id != prev_block)
+            file->scan_linked = 0;
         if (!handle_block || handle_block(block, user_ctx))
-            retval = process_chunk_chain(file, block->chunk, handle_chunk, user_ctx);
+            retval = process_chunk_list(file, chunks, handle_chunk, user_ctx);
+        advise_block(file, next_block-1, 0);
+        if (next_block == last_id || file->scan_stopped)
+            break;
+        prev_block = next_block;
         next_block = block->next_id;
     } while (next_block != 0 && next_block - 1 < file->num_blocks &&
             !blocks_visited[next_block-1] && retval == FMP_OK);
@@ -279,8 +379,53 @@ fmp_error_t process_blocks(fmp_file_t *file,
     return retval;
 }
 
+fmp_error_t process_blocks(fmp_file_t *file,
+        block_handler handle_block,
+        chunk_handler handle_chunk,
+        void *user_ctx) {
+    return process_block_range(file, 2, 0, handle_block, handle_chunk, user_ctx);
+}
+
+/* What a handler returns once the chain has moved past the paths it wants.
+ * If the scan began at the head of the chain and every block walked since
+ * points back at the one before it, the chain is in key order and nothing
+ * further on can be wanted, so the whole scan stops; otherwise only the
+ * rest of this block is skipped. */
+chunk_status_t stop_scan(fmp_file_t *file) {
+    return file->scan_linked ? CHUNK_STOP : CHUNK_DONE;
+}
+
+/* Follows the chain through the sector headers alone, checking that each
+ * block's prev_id points back at the block before it. Files written by
+ * FileMaker keep the chain in key order with both links intact. */
+int chain_is_linked(fmp_file_t *file) {
+    fmp_error_t retval = FMP_OK;
+    size_t this_id = 2;
+    size_t prev_id = 0;
+    size_t count = 0;
+    while (this_id != 0) {
+        if (this_id > file->num_blocks || ++count > file->num_blocks)
+            return 0;
+        fmp_block_t *block = get_block(file, this_id-1, &retval);
+        if (!block || (size_t)block->prev_id != prev_id)
+            return 0;
+        prev_id = this_id;
+        this_id = block->next_id;
+    }
+    return 1;
+}
+
+static fmp_error_t check_sector_count(fmp_file_t *file, fmp_block_t *first_block) {
+    if (first_block->next_id <= 0 ||
+        (first_block->next_id + 1 + (file->version_num < 7)) * file->sector_size != file->file_size) {
+        return FMP_ERROR_BAD_SECTOR_COUNT;
+    }
+    return FMP_OK;
+}
+
 static fmp_file_t *fmp_file_from_stream(FILE *stream, const char *filename, fmp_error_t *errorCode) {
     uint8_t *sector = NULL;
+    char header[1024];
     fmp_error_t retval = FMP_OK;
     fmp_file_t *file = calloc(1, sizeof(fmp_file_t));
     fmp_block_t *first_block = NULL;
@@ -290,18 +435,26 @@ static fmp_file_t *fmp_file_from_stream(FILE *stream, const char *filename, fmp_
         retval = FMP_ERROR_SEEK;
         goto cleanup;
     }
-    file->path_capacity = 16;
-    file->path = calloc(file->path_capacity, sizeof(fmp_data_t *));
     file->file_size = ftello(stream);
     rewind(stream);
 
     if (filename) 
         snprintf(file->filename, sizeof(file->filename), "%s", filename);
 
-    retval = read_header(file);
+    if (!fread(header, sizeof(header), 1, file->stream)) {
+        retval = FMP_ERROR_READ;
+        goto cleanup;
+    }
+
+    retval = read_header(file, header);
     if (retval != FMP_OK)
         goto cleanup;
 
+    if (fseek(file->stream, sector_offset(file, 0), SEEK_SET) == -1) {
+        retval = FMP_ERROR_SEEK;
+        goto cleanup;
+    }
+
     sector = malloc(file->sector_size);
     if (!sector) {
         retval = FMP_ERROR_MALLOC;
@@ -316,23 +469,15 @@ static fmp_file_t *fmp_file_from_stream(FILE *stream, const char *filename, fmp_
     if (!first_block)
         goto cleanup;
 
-    if (first_block->next_id == 0 ||
-        (first_block->next_id + 1 + (file->version_num < 7)) * file->sector_size != file->file_size) {
-        retval = FMP_ERROR_BAD_SECTOR_COUNT;
+    if ((retval = check_sector_count(file, first_block)) != FMP_OK)
         goto cleanup;
-    }
 
-    file = realloc(file, sizeof(fmp_file_t) + first_block->next_id * sizeof(fmp_block_t *));
-    if (!file) {
-        retval = FMP_ERROR_MALLOC;
-        goto cleanup;
-    }
     file->num_blocks = first_block->next_id;
+    if ((retval = grow_blocks(file, file->num_blocks)) != FMP_OK)
+        goto cleanup;
     file->blocks[0] = first_block;
     first_block = NULL;
 
-    memset(&file->blocks[1], 0, (file->num_blocks - 1) * sizeof(fmp_block_t *));
-
     int index = 1;
     while (fread(sector, file->sector_size, 1, file->stream) && index < file->num_blocks) {
         fmp_block_t *block = new_block_from_sector(file, sector, &retval);
@@ -358,25 +503,353 @@ cleanup:
     return file;
 }
 
-fmp_file_t *fmp_open_buffer(const void *buffer, size_t len, fmp_error_t *errorCode) {
-    FILE *stream = NULL;
-#ifdef HAVE_FMEMOPEN
-    stream = fmemopen((void *)buffer, len, "r");
-#else
-    if (errorCode)
-        *errorCode = FMP_ERROR_NO_FMEMOPEN;
-    return NULL;
+/* Blocks are created on demand by get_block() and point straight into the
+ * map, so nothing is read or copied at open beyond the first two sectors.
+ * The map is either a file we mmap'd ourselves or a caller's buffer. */
+static fmp_file_t *fmp_file_from_map(const uint8_t *map, size_t len, int mapped,
+        const char *filename, fmp_error_t *errorCode) {
+    fmp_error_t retval = FMP_OK;
+    fmp_file_t *file = calloc(1, sizeof(fmp_file_t));
+    fmp_block_t *first_block = NULL;
+    if (!file) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    file->map = map;
+    file->map_len = len;
+    file->mapped = mapped;
+    file->file_size = len;
+
+    if (filename)
+        snprintf(file->filename, sizeof(file->filename), "%s", filename);
+
+    if (len < 1024) {
+        retval = FMP_ERROR_READ;
+        goto cleanup;
+    }
+
+    retval = read_header(file, (const char *)map);
+    if (retval != FMP_OK)
+        goto cleanup;
+
+    if (sector_offset(file, 0) + file->sector_size > len) {
+        retval = FMP_ERROR_READ;
+        goto cleanup;
+    }
+
+    first_block = new_block_in_sector(file, map + sector_offset(file, 0), &retval);
+    if (!first_block)
+        goto cleanup;
+
+    if ((retval = check_sector_count(file, first_block)) != FMP_OK)
+        goto cleanup;
+
+    file->num_blocks = first_block->next_id;
+    if ((retval = grow_blocks(file, file->num_blocks)) != FMP_OK)
+        goto cleanup;
+    file->blocks[0] = first_block;
+    first_block = NULL;
+
+cleanup:
+    free(first_block);
+
+    if (retval != FMP_OK) {
+        if (file) {
+            fmp_close_file(file);
+        } else if (mapped) {
+#ifdef HAVE_MMAP
+            munmap((void *)map, len);
 #endif
-    if (!stream) {
+        }
+        if (errorCode)
+            *errorCode = retval;
+        return NULL;
+    }
+    return file;
+}
+
+/* Check every sector header in one sequential pass and remember the chain,
+ * without keeping any payloads around. */
+static fmp_error_t read_sector_headers(fmp_file_t *file, int fd) {
+    size_t batch_len = 256;
+    fmp_error_t retval = FMP_OK;
+    uint8_t *batch = malloc(batch_len * file->sector_size);
+    file->sector_next = calloc(file->num_blocks, sizeof(uint32_t));
+    if (!batch || !file->sector_next) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    for (size_t i=0; i<file->num_blocks; i+=batch_len) {
+        size_t count = file->num_blocks - i;
+        if (count > batch_len)
+            count = batch_len;
+        if (!pread_fully(fd, batch, count * file->sector_size, sector_offset(file, i))) {
+            retval = FMP_ERROR_READ;
+            goto cleanup;
+        }
+        for (size_t j=0; j<count; j++) {
+            fmp_block_t block = { 0 };
+            retval = init_block_in_sector(file, &block, &batch[j * file->sector_size]);
+            if (retval != FMP_OK)
+                goto cleanup;
+            file->sector_next[i+j] = block.next_id;
+        }
+    }
+
+cleanup:
+    free(batch);
+    return retval;
+}
+
+/* Sector indexes in the order process_blocks() visits them */
+static fmp_error_t build_chain_order(fmp_file_t *file) {
+    uint8_t *visited = calloc(file->num_blocks, 1);
+    file->chain_order = malloc(file->num_blocks * sizeof(uint32_t));
+    if (!visited || !file->chain_order) {
+        free(visited);
+        return FMP_ERROR_MALLOC;
+    }
+    size_t next_block = 2;
+    while (next_block != 0 && next_block - 1 < file->num_blocks && !visited[next_block-1]) {
+        visited[next_block-1] = 1;
+        file->chain_order[file->chain_len++] = next_block-1;
+        next_block = file->sector_next[next_block-1];
+    }
+    free(visited);
+    return FMP_OK;
+}
+
+/* Payloads are fetched with pread() as blocks are visited and held in a
+ * fixed-size LRU cache; see cache.c. The sidecar index at path, if given,
+ * is loaded before the sector headers are read, since it has the chain. */
+static fmp_file_t *fmp_file_from_fd(int fd, const char *path, const char *filename,
+        const fmp_open_options_t *options, fmp_error_t *errorCode) {
+    struct stat st;
+    char header[1024];
+    int sector_fd = fd;
+    uint8_t *sector = NULL;
+    fmp_error_t retval = FMP_OK;
+    fmp_file_t *file = calloc(1, sizeof(fmp_file_t));
+    fmp_block_t *first_block = NULL;
+    if (!file) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+
+    if (filename)
+        snprintf(file->filename, sizeof(file->filename), "%s", filename);
+
+    if (fstat(fd, &st) == -1) {
+        retval = FMP_ERROR_SEEK;
+        goto cleanup;
+    }
+    file->file_size = st.st_size;
+
+    if (!pread_fully(fd, (uint8_t *)header, sizeof(header), 0)) {
+        retval = FMP_ERROR_READ;
+        goto cleanup;
+    }
+
+    retval = read_header(file, header);
+    if (retval != FMP_OK)
+        goto cleanup;
+
+    sector = malloc(file->sector_size);
+    if (!sector) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    if (!pread_fully(fd, sector, file->sector_size, sector_offset(file, 0))) {
+        retval = FMP_ERROR_READ;
+        goto cleanup;
+    }
+
+    first_block = new_block_in_sector(file, sector, &retval);
+    if (!first_block)
+        goto cleanup;
+
+    if ((retval = check_sector_count(file, first_block)) != FMP_OK)
+        goto cleanup;
+
+    file->num_blocks = first_block->next_id;
+    if ((retval = grow_blocks(file, file->num_blocks)) != FMP_OK)
+        goto cleanup;
+
+    file->cache = new_cache(fd, options->cache_blocks ? options->cache_blocks : 256,
+            file->sector_size, options->readahead_blocks);
+    if (!file->cache) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    fd = -1;
+
+    if (path)
+        load_index(file, path);
+
+    if ((options->read_headers || options->readahead_blocks || options->physical_order) &&
+            !file->sector_next) {
+        retval = read_sector_headers(file, sector_fd);
+        if (retval != FMP_OK)
+            goto cleanup;
+    }
+
+    if (options->physical_order && (retval = build_chain_order(file)) != FMP_OK)
+        goto cleanup;
+
+    if (options->physical_order)
+        retval = cache_use_chain_order(file);
+
+cleanup:
+    free(sector);
+    free(first_block);
+    if (fd != -1)
+        close(fd);
+
+    if (retval != FMP_OK) {
+        if (file)
+            fmp_close_file(file);
+        if (errorCode)
+            *errorCode = retval;
+        return NULL;
+    }
+    return file;
+}
+
+/* Sectors are read front to back as the chain asks for them, so the input
+ * need not be seekable; see stream.c. The file size is taken on trust from
+ * the index sector since there is no way to check it up front. gzip and
+ * zstd input is recognized and decompressed on the fly. */
+fmp_file_t *fmp_open_stream(FILE *stream, const fmp_open_options_t *options, fmp_error_t *errorCode) {
+    char header[1024];
+    uint8_t *skip = NULL;
+    fmp_error_t retval = FMP_OK;
+    fmp_file_t *file = calloc(1, sizeof(fmp_file_t));
+    fmp_block_t *first_block = NULL;
+    if (!file) {
+        fclose(stream);
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    file->stream = stream;
+
+    if (!(file->stream_source = new_stream_source(stream, &retval)))
+        goto cleanup;
+
+    if ((retval = stream_read(file->stream_source, header, sizeof(header))) != FMP_OK)
+        goto cleanup;
+
+    retval = read_header(file, header);
+    if (retval != FMP_OK)
+        goto cleanup;
+
+    skip = malloc(sector_offset(file, 0) - sizeof(header));
+    first_block = calloc(1, sizeof(fmp_block_t) + file->sector_size);
+    if (!skip || !first_block) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    if ((retval = stream_read(file->stream_source, skip, sector_offset(file, 0) - sizeof(header))) != FMP_OK ||
+            (retval = stream_read(file->stream_source, &first_block[1], file->sector_size)) != FMP_OK)
+        goto cleanup;
+
+    if ((retval = init_block_in_sector(file, first_block, (uint8_t *)&first_block[1])) != FMP_OK)
+        goto cleanup;
+
+    if (first_block->next_id <= 0) {
+        retval = FMP_ERROR_BAD_SECTOR_COUNT;
+        goto cleanup;
+    }
+
+    /* The sector count can't be checked against anything yet, so blocks[]
+     * only grows as far as the sectors that actually arrive */
+    file->num_blocks = first_block->next_id;
+    file->file_size = sector_offset(file, file->num_blocks);
+    if ((retval = grow_blocks(file, 1)) != FMP_OK)
+        goto cleanup;
+    file->blocks[0] = first_block;
+    first_block = NULL;
+
+    retval = stream_source_start(file, options ? options->stream_memory_blocks : 0);
+
+cleanup:
+    free(skip);
+    free(first_block);
+
+    if (retval != FMP_OK) {
+        if (file)
+            fmp_close_file(file);
+        if (errorCode)
+            *errorCode = retval;
+        return NULL;
+    }
+    return file;
+}
+
+static fmp_file_t *fmp_open_file_mmap(const char *path, const char *filename, fmp_error_t *errorCode) {
+#ifdef HAVE_MMAP
+    struct stat st;
+    void *map = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
         if (errorCode)
             *errorCode = FMP_ERROR_OPEN;
         return NULL;
     }
-    return fmp_file_from_stream(stream, NULL, errorCode);
+    if (fstat(fd, &st) == -1 || st.st_size < 1024) {
+        close(fd);
+        if (errorCode)
+            *errorCode = FMP_ERROR_READ;
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (errorCode)
+            *errorCode = FMP_ERROR_OPEN;
+        return NULL;
+    }
+#ifdef HAVE_MADVISE
+    /* The sector chain is not in physical order; see advise_block() */
+    madvise(map, st.st_size, MADV_RANDOM);
+#endif
+    return fmp_file_from_map(map, st.st_size, 1, filename, errorCode);
+#else
+    if (errorCode)
+        *errorCode = FMP_ERROR_NO_MMAP;
+    return NULL;
+#endif
 }
 
-fmp_file_t *fmp_open_file(const char *path, fmp_error_t *errorCode) {
+/* The buffer is borrowed, not copied; see fmp.h */
+fmp_file_t *fmp_open_buffer(const void *buffer, size_t len, fmp_error_t *errorCode) {
+    return fmp_file_from_map(buffer, len, 0, NULL, errorCode);
+}
+
+/* Compressed files go through the stream reader with a bounded number of
+ * sectors in memory. The compression suffix is dropped from the filename,
+ * which fp3/fp5 files use as their table name. */
+static fmp_file_t *fmp_open_compressed_file(FILE *stream, char *filename,
+        const fmp_open_options_t *options, fmp_error_t *errorCode) {
+    fmp_open_options_t stream_options = { 0 };
+    if (options)
+        stream_options = *options;
+    if (!stream_options.stream_memory_blocks)
+        stream_options.stream_memory_blocks = 256;
+    char *extension = strrchr(filename, '.');
+    if (extension && (strcasecmp(extension, ".gz") == 0 || strcasecmp(extension, ".zst") == 0))
+        *extension = '\0';
+    fmp_file_t *file = fmp_open_stream(stream, &stream_options, errorCode);
+    if (file)
+        snprintf(file->filename, sizeof(file->filename), "%s", filename);
+    return file;
+}
+
+fmp_file_t *fmp_open_file_with_options(const char *path,
+        const fmp_open_options_t *options, fmp_error_t *errorCode) {
     fmp_file_t *file = NULL;
+    fmp_io_mode_t io_mode = options ? options->io_mode : FMP_IO_DEFAULT;
+    const char *index_path = (options && options->skip_index) ? NULL : path;
+    uint8_t magic[4];
     FILE *stream = fopen(path, "r");
     if (!stream) {
         if (errorCode)
@@ -384,24 +857,63 @@ fmp_file_t *fmp_open_file(const char *path, fmp_error_t *errorCode) {
         return NULL;
     }
     char *path_copy = strdup(path);
-    file = fmp_file_from_stream(stream, basename(path_copy), errorCode);
+    if (io_mode == FMP_IO_DEFAULT) {
+#ifdef HAVE_MMAP
+        io_mode = FMP_IO_MMAP;
+#else
+        io_mode = FMP_IO_READ;
+#endif
+    }
+    if (is_compressed(magic, fread(magic, 1, sizeof(magic), stream))) {
+        rewind(stream);
+        file = fmp_open_compressed_file(stream, basename(path_copy), options, errorCode);
+    } else if (io_mode == FMP_IO_MMAP) {
+        fclose(stream);
+        file = fmp_open_file_mmap(path, basename(path_copy), errorCode);
+        if (file && index_path)
+            load_index(file, index_path);
+    } else if (io_mode == FMP_IO_PREAD) {
+        fclose(stream);
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            file = fmp_file_from_fd(fd, index_path, basename(path_copy), options, errorCode);
+        } else if (errorCode) {
+            *errorCode = FMP_ERROR_OPEN;
+        }
+    } else {
+        rewind(stream);
+        file = fmp_file_from_stream(stream, basename(path_copy), errorCode);
+        if (file && index_path)
+            load_index(file, index_path);
+    }
     free(path_copy);
     return file;
 }
 
+fmp_file_t *fmp_open_file(const char *path, fmp_error_t *errorCode) {
+    return fmp_open_file_with_options(path, NULL, errorCode);
+}
+
 void fmp_close_file(fmp_file_t *file) {
     if (file->stream)
         fclose(file->stream);
+#ifdef HAVE_MMAP
+    if (file->mapped)
+        munmap((void *)file->map, file->map_len);
+#endif
     if (file->converter)
         iconv_close(file->converter);
-    if (file->path)
-        free(file->path);
-    for (int i=0; i<file->num_blocks; i++) {
-        fmp_block_t *block = file->blocks[i];
-        if (block) {
-            free_chunk_chain(block);
-            free(block);
-        }
-    }
+    if (file->cache)
+        free_cache(file, file->cache);
+    if (file->stream_source)
+        free_stream_source(file->stream_source);
+    free(file->sector_next);
+    free(file->chain_order);
+    free_chunk_list(file->scan_chunks);
+    free_directory(file->directory);
+    free_schema(file->schema);
+    for (size_t i=0; i<file->blocks_allocated; i++)
+        free(file->blocks[i]);
+    free(file->blocks);
     free(file);
 }
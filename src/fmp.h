@@ -29,6 +29,7 @@ extern "C" {
 
 #include <iconv.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
 typedef enum {
@@ -46,8 +47,23 @@ typedef enum {
     FMP_ERROR_UNRECOGNIZED_CODE,
     FMP_ERROR_UNSUPPORTED_CHARACTER_SET,
     FMP_ERROR_USER_ABORTED,
+    FMP_ERROR_NO_MMAP,
+    FMP_ERROR_NO_DECOMPRESSOR,
+    FMP_ERROR_BAD_PATTERN,
+    FMP_ERROR_OUT_OF_ORDER,
+    FMP_ERROR_WRITE,
+    FMP_ERROR_BAD_INDEX,
+    FMP_ERROR_CANNOT_INDEX,
+    FMP_ERROR_NO_SUCH_RECORD,
 } fmp_error_t;
 
+typedef enum {
+    FMP_IO_DEFAULT,
+    FMP_IO_READ,
+    FMP_IO_MMAP,
+    FMP_IO_PREAD
+} fmp_io_mode_t;
+
 typedef enum {
     FMP_COLUMN_TYPE_UNKNOWN,
     FMP_COLUMN_TYPE_TEXT,
@@ -128,17 +144,30 @@ typedef struct fmp_table_array_s {
     fmp_table_t *tables;
 } fmp_table_array_t;
 
+typedef struct fmp_column_stats_s {
+    fmp_column_t column;
+    size_t value_count; /* values stored, in as many rows or repetitions */
+    size_t byte_count; /* raw bytes of those values, before conversion */
+} fmp_column_stats_t;
+
+typedef struct fmp_table_stats_s {
+    size_t row_count;
+    size_t byte_count;
+    size_t count;
+    fmp_column_stats_t *columns; /* in the order fmp_list_columns gives */
+} fmp_table_stats_t;
+
 typedef struct fmp_data_s {
     size_t len;
     uint8_t *bytes;
 } fmp_data_t;
 
 typedef struct fmp_chunk_s {
-    struct fmp_chunk_s *next;
     fmp_data_t ref_long;
     fmp_data_t data;
     fmp_chunk_type_t type;
     fmp_data_t **path;
+    uint64_t *path_values;
     uint8_t path_level;
     uint8_t version_num;
     uint8_t code;
@@ -154,13 +183,32 @@ typedef struct fmp_block_s {
     int next_id;
     int prev_id;
     int this_id;
-    fmp_chunk_t *chunk;
     size_t payload_len;
-    uint8_t payload[];
+    uint8_t *payload;
 } fmp_block_t;
 
+typedef struct fmp_open_options_s {
+    fmp_io_mode_t io_mode;
+    size_t cache_blocks; /* FMP_IO_PREAD: sectors held in memory at once */
+    int read_headers; /* FMP_IO_PREAD: read and check every sector header at open */
+    size_t readahead_blocks; /* FMP_IO_PREAD: sectors to read ahead in chain order; implies read_headers */
+    int physical_order; /* FMP_IO_PREAD: fill the cache with sorted reads of the coming chain; implies read_headers */
+    size_t stream_memory_blocks; /* fmp_open_stream: sectors held in memory before spilling to a temporary file; 0 for no limit, or 256 for compressed files */
+    int skip_index; /* fmp_open_file_with_options: don't load the sidecar index, path.fmpidx */
+} fmp_open_options_t;
+
+#define FMP_MAX_PATH_DEPTH 32 /* Deepest path within a block; real files reach 9 */
+
 typedef struct fmp_file_s {
     FILE *stream;
+    const uint8_t *map;
+    size_t map_len;
+    int mapped;
+    struct fmp_cache_s *cache;
+    struct fmp_stream_source_s *stream_source;
+    uint32_t *sector_next;
+    uint32_t *chain_order;
+    size_t chain_len;
     char version_string[10];
     char version_date_string[8];
     struct tm version_date;
@@ -176,25 +224,134 @@ typedef struct fmp_file_s {
     iconv_t converter;
     unsigned char    xor_mask;
     size_t path_level;
-    size_t path_capacity;
-    fmp_data_t **path;
+    fmp_data_t *path[FMP_MAX_PATH_DEPTH];
+    fmp_data_t path_data[FMP_MAX_PATH_DEPTH];
+    uint64_t path_values[FMP_MAX_PATH_DEPTH];
+    struct fmp_chunk_list_s *scan_chunks;
+    int scan_linked;
+    int scan_stopped;
+    struct fmp_directory_s *directory;
+    struct fmp_schema_s *schema;
     size_t num_blocks;
-    fmp_block_t *blocks[];
+    size_t blocks_allocated;
+    fmp_block_t **blocks;
 } fmp_file_t;
 
 typedef fmp_handler_status_t (*fmp_value_handler)(int row, fmp_column_t *column, const char *value, void *ctx);
+typedef fmp_handler_status_t (*fmp_chunk_handler)(int pattern, fmp_chunk_t *chunk, void *ctx);
+typedef fmp_handler_status_t (*fmp_table_handler)(fmp_table_t *table, fmp_column_array_t *columns, void *ctx);
+typedef fmp_handler_status_t (*fmp_table_value_handler)(fmp_table_t *table,
+        int row, fmp_column_t *column, const char *value, void *ctx);
+
+typedef struct fmp_query_s fmp_query_t;
+typedef struct fmp_filter_s fmp_filter_t;
 
 fmp_file_t *fmp_open_file(const char *path, fmp_error_t *errorCode);
+fmp_file_t *fmp_open_file_with_options(const char *path,
+        const fmp_open_options_t *options, fmp_error_t *errorCode);
+/* Reads the database in place rather than copying it: the buffer must stay
+ * alive and unchanged until fmp_close_file() */
 fmp_file_t *fmp_open_buffer(const void *buffer, size_t len, fmp_error_t *errorCode);
+/* Reads the database front to back from stream, which needn't be seekable.
+ * The stream belongs to the file handle from then on: fmp_close_file()
+ * closes it, and it's closed right away if the open fails. */
+fmp_file_t *fmp_open_stream(FILE *stream, const fmp_open_options_t *options, fmp_error_t *errorCode);
 
+/* Tables and columns are read in one pass the first time any of them is
+ * needed and kept until the file is closed; the arrays returned here are
+ * the caller's copies. Columns handed to value handlers belong to the file
+ * and stay valid until it's closed. */
 fmp_table_array_t *fmp_list_tables(fmp_file_t *file, fmp_error_t *errorCode);
 fmp_column_array_t *fmp_list_columns(fmp_file_t *file, fmp_table_t *table, fmp_error_t *errorCode);
 fmp_error_t fmp_read_values(fmp_file_t *file, fmp_table_t *table, fmp_value_handler handle_value, void *ctx);
+
+/* As fmp_read_values, but only the values of the given columns, as
+ * fmp_list_columns gives them, are converted and handed over; the rest are
+ * skipped before any conversion. Rows are numbered as fmp_read_values
+ * numbers them. */
+fmp_error_t fmp_read_values_with_columns(fmp_file_t *file, fmp_table_t *table,
+        fmp_column_array_t *columns, fmp_value_handler handle_value, void *ctx);
+
+/* As fmp_read_values_with_columns, with columns NULL meaning all of them,
+ * but only rows that meet every condition of the filter are handed over.
+ * Conditions compare the bytes stored in the file, so rows that fail are
+ * never converted (see the row filters below for how operands are given). */
+fmp_error_t fmp_read_values_where(fmp_file_t *file, fmp_table_t *table,
+        fmp_column_array_t *columns, fmp_filter_t *filter, fmp_value_handler handle_value, void *ctx);
+
+/* Counts a table's rows as fmp_read_values numbers them, without converting
+ * any values. The count is kept with the file's tables and columns. */
+fmp_error_t fmp_count_rows(fmp_file_t *file, fmp_table_t *table, size_t *count);
+
+/* Reads count rows starting at first_row, numbered from 1 as
+ * fmp_read_values numbers them. The first read of a table scans all of it,
+ * noting where rows begin along the way; later reads start from the
+ * nearest such point, so a page deep in the table costs about as much as
+ * one near its start. */
+fmp_error_t fmp_read_rows(fmp_file_t *file, fmp_table_t *table, size_t first_row, size_t count,
+        fmp_value_handler handle_value, void *ctx);
+
+/* Reads the values of the record FileMaker filed under record_id, handing
+ * them over with the row number fmp_read_values would give them. Like
+ * fmp_read_rows it starts a block or so short of the record once the
+ * table has been scanned. Returns FMP_ERROR_NO_SUCH_RECORD if there's no
+ * such record, or it holds no values. */
+fmp_error_t fmp_get_record(fmp_file_t *file, fmp_table_t *table, size_t record_id,
+        fmp_value_handler handle_value, void *ctx);
+
+/* Tallies a table's rows and, per column, the values stored and their size
+ * in the file, in one scan that converts nothing */
+fmp_table_stats_t *fmp_table_stats(fmp_file_t *file, fmp_table_t *table, fmp_error_t *errorCode);
+void fmp_free_table_stats(fmp_table_stats_t *stats);
+
+/* Reads every table in tables, as returned by fmp_list_tables, in one pass
+ * over the file where their values lie in table order on the chain, or
+ * else a table at a time. Each table is handed to handle_table with its
+ * columns, in index order and before any of its values; tables without
+ * values are handed over too. Either handler may be NULL. Returns
+ * FMP_ERROR_OUT_OF_ORDER only if a single block mixes two tables' values
+ * out of order. */
+fmp_error_t fmp_read_all_values(fmp_file_t *file, fmp_table_array_t *tables,
+        fmp_table_handler handle_table, fmp_table_value_handler handle_value, void *ctx);
 fmp_error_t fmp_dump_file(fmp_file_t *file);
 
+/* Writes or refreshes the sidecar index of the file at path, path.fmpidx,
+ * which holds the file's chain order, tables, columns, table locations and
+ * row counts. fmp_open_file and fmp_open_file_with_options load it when it
+ * matches the file's size, modification time and leading sectors, and
+ * skip the scans that would otherwise learn the same things. Compressed
+ * files can't be indexed. */
+fmp_error_t fmp_build_index(const char *path);
+
+/* Path queries: register patterns such as "[128+*].[3].[5].*" (see
+ * fmp_query_add_path in query.c for the syntax), then fmp_query_file calls
+ * the handler with every chunk whose path matches, data unmasked, along
+ * with the index of the pattern it matched. In fp3 and fp5 files the
+ * file's B-tree is used to read only the blocks the patterns can reach. */
+fmp_query_t *fmp_new_query(fmp_error_t *errorCode);
+int fmp_query_add_path(fmp_query_t *query, const char *pattern, fmp_error_t *errorCode);
+fmp_error_t fmp_query_file(fmp_file_t *file, fmp_query_t *query,
+        fmp_chunk_handler handle_chunk, void *ctx);
+
+/* Row filters for fmp_read_values_where. A row passes a condition if any of
+ * the column's values in it does; a column with no value counts as "".
+ * Operands are bytes as stored, except that LF stands for the CR FileMaker
+ * stores at line breaks. Tabs, which fp7 and fmp12 values show as spaces,
+ * must be given as tabs. A NULL operand to fmp_filter_equals or
+ * fmp_filter_prefix is the same as "", and a NULL bound to fmp_filter_range
+ * leaves that end open. */
+fmp_filter_t *fmp_new_filter(fmp_error_t *errorCode);
+fmp_error_t fmp_filter_equals(fmp_filter_t *filter, fmp_column_t *column, const void *bytes, size_t len);
+fmp_error_t fmp_filter_prefix(fmp_filter_t *filter, fmp_column_t *column, const void *bytes, size_t len);
+fmp_error_t fmp_filter_range(fmp_filter_t *filter, fmp_column_t *column,
+        const void *min, size_t min_len, const void *max, size_t max_len);
+fmp_error_t fmp_filter_not_empty(fmp_filter_t *filter, fmp_column_t *column);
+
 void fmp_close_file(fmp_file_t *file);
 void fmp_free_tables(fmp_table_array_t *array);
 void fmp_free_columns(fmp_column_array_t *array);
+void fmp_free_query(fmp_query_t *query);
+void fmp_free_filter(fmp_filter_t *filter);
 
 #ifdef __cplusplus
 }
@@ -1,9 +1,108 @@
 typedef enum {
     CHUNK_NEXT,
-    CHUNK_DONE,
+    CHUNK_DONE, /* with this block */
+    CHUNK_STOP, /* with the whole scan */
     CHUNK_ABORT
 } chunk_status_t;
 
+typedef struct fmp_cache_s fmp_cache_t;
+typedef struct fmp_readahead_s fmp_readahead_t;
+typedef struct fmp_stream_source_s fmp_stream_source_t;
+typedef struct fmp_decoder_s fmp_decoder_t;
+
+#define CHUNK_EXTENDED 0x01
+
+/* One block's chunks, one array per field. Data and long keys are offsets
+ * into the payload; key holds ref_simple or segment_index by type. */
+typedef struct fmp_chunk_list_s {
+    size_t count;
+    size_t capacity;
+    uint8_t *payload;
+    size_t payload_len;
+    uint32_t *data_offset;
+    uint32_t *ref_long_offset;
+    uint16_t *data_len;
+    uint16_t *key;
+    uint8_t *ref_long_len;
+    uint8_t *type;
+    uint8_t *code;
+    uint8_t *flags;
+    uint8_t *unmasked;
+    int unmasked_ready;
+} fmp_chunk_list_t;
+
+typedef enum {
+    FMP_READ_PENDING,
+    FMP_READ_DONE,
+    FMP_READ_FAILED
+} fmp_read_status_t;
+
+typedef struct fmp_read_request_s {
+    uint8_t *buf;
+    size_t len;
+    size_t offset;
+    fmp_read_status_t status;
+    struct fmp_read_request_s *next;
+} fmp_read_request_t;
+
+typedef struct fmp_block_range_s {
+    uint32_t first_id;
+    uint32_t last_id;
+    uint32_t first_pos; /* places on the chain, counting from 1; 0 if not known */
+    uint32_t last_pos;
+} fmp_block_range_t;
+
+typedef struct fmp_directory_s {
+    int valid;
+    size_t count;
+    fmp_block_range_t *roots; /* indexed by root path value */
+} fmp_directory_t;
+
+/* Where a scan of a table stood as it reached a block: the rows begun
+ * before it, and the row path and column of the last value seen */
+typedef struct fmp_row_mark_s {
+    uint32_t block_id;
+    size_t row;
+    size_t last_row;
+    size_t last_column;
+} fmp_row_mark_t;
+
+typedef struct fmp_table_schema_s {
+    fmp_column_array_t columns; /* as fmp_list_columns returns them */
+    size_t slot_count;
+    fmp_column_t **slots; /* indexed by column index - 1; NULL if never named */
+    int counted;
+    size_t row_count;
+    size_t mark_count;
+    fmp_row_mark_t *marks; /* one per block that rows begin before; complete once counted */
+    int ordered; /* whether rows came in order of record id when counted */
+} fmp_table_schema_t;
+
+typedef enum {
+    FMP_FILTER_EQUALS,
+    FMP_FILTER_PREFIX,
+    FMP_FILTER_RANGE,
+    FMP_FILTER_NOT_EMPTY
+} fmp_filter_op_t;
+
+typedef struct fmp_condition_s {
+    size_t column_index;
+    fmp_filter_op_t op;
+    fmp_data_t operand; /* or the range's lower bound; NULL bytes if open */
+    fmp_data_t max;
+} fmp_condition_t;
+
+struct fmp_filter_s {
+    size_t count;
+    fmp_condition_t *conditions;
+};
+
+typedef struct fmp_schema_s {
+    fmp_table_array_t tables; /* as fmp_list_tables returns them */
+    size_t count;
+    fmp_table_schema_t *by_index; /* indexed by table index - 1 */
+} fmp_schema_t;
+
 typedef int (*block_handler)(fmp_block_t *block, void *ctx);
 typedef chunk_status_t (*chunk_handler)(fmp_chunk_t *chunk, void *ctx);
 
@@ -13,15 +112,72 @@ fmp_error_t process_blocks(fmp_file_t *file,
         block_handler handle_block,
         chunk_handler handle_chunk,
         void *user_ctx);
-fmp_error_t process_block(fmp_file_t *file, fmp_block_t *block);
+fmp_error_t process_block_range(fmp_file_t *file, size_t first_id, size_t last_id,
+        block_handler handle_block,
+        chunk_handler handle_chunk,
+        void *user_ctx);
+fmp_error_t process_table_blocks(fmp_file_t *file, size_t table_index,
+        chunk_handler handle_chunk, void *user_ctx);
+fmp_error_t process_table_blocks_from(fmp_file_t *file, size_t table_index, size_t first_id,
+        block_handler handle_block, chunk_handler handle_chunk, void *user_ctx);
+fmp_error_t process_chunk_list(fmp_file_t *file, fmp_chunk_list_t *list,
+        chunk_handler handle_chunk, void *user_ctx);
+fmp_error_t grow_blocks(fmp_file_t *file, size_t count);
+fmp_block_t *get_block(fmp_file_t *file, size_t index, fmp_error_t *errorCode);
+int chain_is_linked(fmp_file_t *file);
+chunk_status_t stop_scan(fmp_file_t *file);
+size_t seek_path(fmp_file_t *file, const uint64_t *path, size_t depth, int past);
+fmp_error_t build_directory(fmp_file_t *file, chunk_handler handle_chunk, void *user_ctx);
+void free_directory(fmp_directory_t *directory);
+fmp_error_t load_schema(fmp_file_t *file);
+fmp_error_t load_tables(fmp_file_t *file, fmp_table_array_t *array);
+fmp_error_t finish_table_schema(fmp_table_schema_t *table);
+fmp_table_schema_t *table_schema(fmp_file_t *file, size_t table_index);
+void free_schema(fmp_schema_t *schema);
+int condition_matches(fmp_condition_t *condition, const uint8_t *bytes, size_t len);
+fmp_error_t load_index(fmp_file_t *file, const char *path);
+fmp_error_t process_block(fmp_file_t *file, fmp_block_t *block, fmp_chunk_list_t **chunks);
+void free_chunk_list(fmp_chunk_list_t *list);
 fmp_block_t *new_block_from_sector(fmp_file_t *file, const uint8_t *sector, fmp_error_t *error);
+fmp_block_t *new_block_in_sector(fmp_file_t *file, const uint8_t *sector, fmp_error_t *error);
+fmp_error_t init_block_in_sector(fmp_file_t *file, fmp_block_t *block, const uint8_t *sector);
+size_t sector_offset(fmp_file_t *file, size_t index);
+
+fmp_cache_t *new_cache(int fd, size_t capacity, size_t sector_size, size_t readahead_depth);
+void free_cache(fmp_file_t *file, fmp_cache_t *cache);
+fmp_block_t *cache_get_block(fmp_file_t *file, size_t index, fmp_error_t *error);
+void cache_readahead(fmp_file_t *file, size_t index);
+fmp_error_t cache_use_chain_order(fmp_file_t *file);
+void cache_advise_block(fmp_file_t *file, size_t index);
+
+fmp_readahead_t *new_readahead(int fd, size_t depth);
+void readahead_submit(fmp_readahead_t *ra, fmp_read_request_t *request);
+void readahead_wait(fmp_readahead_t *ra, fmp_read_request_t *request);
+void free_readahead(fmp_readahead_t *ra);
+int pread_fully(int fd, uint8_t *buf, size_t len, size_t offset);
+
+fmp_stream_source_t *new_stream_source(FILE *stream, fmp_error_t *error);
+fmp_error_t stream_source_start(fmp_file_t *file, size_t memory_limit);
+fmp_error_t stream_read(fmp_stream_source_t *source, void *buf, size_t len);
+void free_stream_source(fmp_stream_source_t *source);
+fmp_block_t *stream_get_block(fmp_file_t *file, size_t index, fmp_error_t *error);
+
+int is_compressed(const uint8_t *magic, size_t len);
+fmp_decoder_t *new_decoder(FILE *stream, const uint8_t *prefix, size_t prefix_len, fmp_error_t *error);
+size_t decoder_read(fmp_decoder_t *dec, uint8_t *buf, size_t len);
+int decoder_can_seek(fmp_decoder_t *dec);
+fmp_error_t decoder_pread(fmp_decoder_t *dec, uint8_t *buf, size_t len, size_t offset);
+void free_decoder(fmp_decoder_t *dec);
 
-void convert(iconv_t converter, uint8_t xor_mask,
+uint8_t *unmask_data(fmp_file_t *file, fmp_data_t *data);
+void unmask_bytes(uint8_t *dst, const uint8_t *src, size_t len, uint8_t mask);
+void convert(iconv_t converter,
         char *dst, size_t dst_len, uint8_t *src, size_t src_len);
 size_t convert_scsu_to_utf8(
         char **restrict inbuf, size_t *restrict inbytesleft,
         char **restrict outbuf, size_t *restrict outbytesleft);
 
+int path_is_table_part(fmp_chunk_t *chunk);
 int table_path_match_start1(fmp_chunk_t *chunk, int depth, int val);
 int table_path_match_start2(fmp_chunk_t *chunk, int depth, int val1, int val2);
 int path_is(fmp_chunk_t *chunk, fmp_data_t *path, uint64_t value);
@@ -24,6 +24,13 @@
 #include <stdlib.h>
 #include "../fmp.h"
 
+static fmp_handler_status_t handle_chunk(int pattern, fmp_chunk_t *chunk, void *ctx) {
+    size_t *sum = (size_t *)ctx;
+    for (int i=0; i<chunk->data.len; i++)
+        *sum += chunk->data.bytes[i];
+    return FMP_HANDLER_OK;
+}
+
 int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
     fmp_error_t error = FMP_OK;
     fmp_file_t *file = fmp_open_buffer(Data, Size, &error);
@@ -37,6 +44,14 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
             }
             fmp_free_tables(tables);
         }
+        fmp_query_t *query = fmp_new_query(&error);
+        if (query) {
+            size_t sum = 0;
+            fmp_query_add_path(query, "[128+*].[3].[5].*", &error);
+            fmp_query_add_path(query, "[4].[1].[7].[*]", &error);
+            fmp_query_file(file, query, handle_chunk, &sum);
+            fmp_free_query(query);
+        }
         fmp_close_file(file);
     }
     return 0;
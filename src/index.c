@@ -0,0 +1,547 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* The sidecar index, path.fmpidx, saves what the first scans of a file
+ * learn: the order of its chain, the directory of table ranges, the tables
+ * and columns, and any row counts, along with the marks that let a range
+ * of rows be read without scanning from the table's start. It's keyed by
+ * the file's size and modification time and a hash of its header and of
+ * its first two and last sectors; if any of those differ, or the index is
+ * damaged, it's ignored and the file is scanned as usual.
+ *
+ * All integers are little-endian. After the key come the chain as sector
+ * indexes, the directory's block ranges by root, the tables, then each
+ * table's columns, row count and row marks by table index, and last a hash
+ * of all that precedes it. */
+
+#define INDEX_MAGIC "FMPIDX03"
+#define INDEX_MAX_COUNT 0x1000000
+
+typedef struct fmp_index_writer_s {
+    uint8_t *bytes;
+    size_t len;
+    size_t capacity;
+    int failed;
+} fmp_index_writer_t;
+
+typedef struct fmp_index_reader_s {
+    const uint8_t *bytes;
+    size_t len;
+    size_t pos;
+    int failed;
+} fmp_index_reader_t;
+
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t len) {
+    const uint8_t *p = (const uint8_t *)bytes;
+    for (size_t i=0; i<len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_u32(uint64_t hash, uint32_t value) {
+    uint8_t bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24 };
+    return hash_bytes(hash, bytes, sizeof(bytes));
+}
+
+static fmp_error_t hash_file(fmp_file_t *file, uint64_t *hash) {
+    size_t indexes[] = { 0, 1, file->num_blocks - 1 };
+    *hash = hash_bytes(0xcbf29ce484222325ULL, file->version_string, sizeof(file->version_string));
+    *hash = hash_bytes(*hash, file->version_date_string, sizeof(file->version_date_string));
+    for (int i=0; i<sizeof(indexes)/sizeof(indexes[0]); i++) {
+        fmp_error_t retval = FMP_OK;
+        if (indexes[i] >= file->num_blocks)
+            continue;
+        fmp_block_t *block = get_block(file, indexes[i], &retval);
+        if (!block)
+            return retval;
+        *hash = hash_u32(*hash, block->level);
+        *hash = hash_u32(*hash, block->prev_id);
+        *hash = hash_u32(*hash, block->next_id);
+        *hash = hash_bytes(*hash, block->payload, block->payload_len);
+    }
+    return FMP_OK;
+}
+
+static void put_bytes(fmp_index_writer_t *w, const void *bytes, size_t len) {
+    if (w->failed)
+        return;
+    if (w->len + len > w->capacity) {
+        size_t capacity = w->capacity ? w->capacity : 4096;
+        while (capacity < w->len + len)
+            capacity *= 2;
+        uint8_t *grown = realloc(w->bytes, capacity);
+        if (!grown) {
+            w->failed = 1;
+            return;
+        }
+        w->bytes = grown;
+        w->capacity = capacity;
+    }
+    memcpy(&w->bytes[w->len], bytes, len);
+    w->len += len;
+}
+
+static void put_u32(fmp_index_writer_t *w, uint32_t value) {
+    uint8_t bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24 };
+    put_bytes(w, bytes, sizeof(bytes));
+}
+
+static void put_u64(fmp_index_writer_t *w, uint64_t value) {
+    put_u32(w, value & 0xFFFFFFFF);
+    put_u32(w, value >> 32);
+}
+
+static void put_name(fmp_index_writer_t *w, const char *name) {
+    size_t len = strlen(name);
+    put_u32(w, len);
+    put_bytes(w, name, len);
+}
+
+static const uint8_t *get_bytes(fmp_index_reader_t *r, size_t len) {
+    if (r->failed || len > r->len - r->pos) {
+        r->failed = 1;
+        return NULL;
+    }
+    r->pos += len;
+    return &r->bytes[r->pos - len];
+}
+
+static uint32_t get_u32(fmp_index_reader_t *r) {
+    const uint8_t *b = get_bytes(r, 4);
+    if (!b)
+        return 0;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static uint64_t get_u64(fmp_index_reader_t *r) {
+    uint64_t low = get_u32(r);
+    return low | ((uint64_t)get_u32(r) << 32);
+}
+
+/* Counts that size allocations are capped, in case the hash was fooled */
+static uint32_t get_count(fmp_index_reader_t *r) {
+    uint32_t count = get_u32(r);
+    if (count > INDEX_MAX_COUNT)
+        r->failed = 1;
+    return r->failed ? 0 : count;
+}
+
+static void get_name(fmp_index_reader_t *r, char *name, size_t size) {
+    uint32_t len = get_u32(r);
+    const uint8_t *bytes = len < size ? get_bytes(r, len) : NULL;
+    if (!bytes) {
+        r->failed = 1;
+        return;
+    }
+    memcpy(name, bytes, len);
+    name[len] = '\0';
+}
+
+static char *index_path(const char *path) {
+    char *sidecar = malloc(strlen(path) + sizeof(".fmpidx"));
+    if (sidecar)
+        sprintf(sidecar, "%s.fmpidx", path);
+    return sidecar;
+}
+
+static void put_key(fmp_index_writer_t *w, fmp_file_t *file, struct stat *st, uint64_t hash) {
+    put_bytes(w, INDEX_MAGIC, strlen(INDEX_MAGIC));
+    put_u64(w, st->st_size);
+    put_u64(w, (uint64_t)st->st_mtime);
+    put_u64(w, hash);
+    put_u32(w, file->sector_size);
+    put_u32(w, file->num_blocks);
+}
+
+/* Sector indexes in chain order, from the headers read at open if there
+ * are any, or else by following the chain */
+static uint32_t *collect_chain(fmp_file_t *file, size_t *len, fmp_error_t *error) {
+    uint8_t *visited = calloc(file->num_blocks, 1);
+    uint32_t *chain = malloc(file->num_blocks * sizeof(uint32_t));
+    size_t next_block = 2;
+    *len = 0;
+    if (!visited || !chain) {
+        *error = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    while (next_block != 0 && next_block - 1 < file->num_blocks && !visited[next_block-1]) {
+        visited[next_block-1] = 1;
+        chain[(*len)++] = next_block-1;
+        if (file->sector_next) {
+            next_block = file->sector_next[next_block-1];
+        } else {
+            fmp_block_t *block = get_block(file, next_block-1, error);
+            if (!block)
+                goto cleanup;
+            next_block = block->next_id;
+        }
+    }
+    free(visited);
+    return chain;
+
+cleanup:
+    free(visited);
+    free(chain);
+    return NULL;
+}
+
+static fmp_error_t write_index(fmp_file_t *file, const char *path) {
+    fmp_index_writer_t w = { 0 };
+    fmp_error_t retval = FMP_OK;
+    char *sidecar = index_path(path);
+    char *temp_path = sidecar ? malloc(strlen(sidecar) + sizeof(".tmp")) : NULL;
+    uint32_t *chain = NULL;
+    size_t chain_len = 0;
+    fmp_directory_t *directory = NULL;
+    fmp_schema_t *schema = NULL;
+    FILE *stream = NULL;
+    struct stat st;
+    uint64_t hash = 0;
+    if (!temp_path) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    sprintf(temp_path, "%s.tmp", sidecar);
+    if (stat(path, &st) == -1) {
+        retval = FMP_ERROR_OPEN;
+        goto cleanup;
+    }
+    if ((retval = hash_file(file, &hash)) != FMP_OK)
+        goto cleanup;
+    if ((retval = load_schema(file)) != FMP_OK)
+        goto cleanup;
+    schema = file->schema;
+    directory = file->directory;
+    for (size_t i=0; i<schema->tables.count; i++) {
+        size_t row_count = 0;
+        if ((retval = fmp_count_rows(file, &schema->tables.tables[i], &row_count)) != FMP_OK)
+            goto cleanup;
+    }
+    if (!(chain = collect_chain(file, &chain_len, &retval)))
+        goto cleanup;
+
+    put_key(&w, file, &st, hash);
+    put_u32(&w, chain_len);
+    for (size_t i=0; i<chain_len; i++)
+        put_u32(&w, chain[i]);
+
+    put_u32(&w, directory ? directory->valid : 0);
+    put_u32(&w, directory ? directory->count : 0);
+    for (size_t i=0; directory && i<directory->count; i++) {
+        put_u32(&w, directory->roots[i].first_id);
+        put_u32(&w, directory->roots[i].last_id);
+    }
+
+    put_u32(&w, schema->tables.count);
+    for (size_t i=0; i<schema->tables.count; i++) {
+        put_u32(&w, schema->tables.tables[i].index);
+        put_name(&w, schema->tables.tables[i].utf8_name);
+    }
+    put_u32(&w, schema->count);
+    for (size_t i=0; i<schema->count; i++) {
+        fmp_table_schema_t *table = &schema->by_index[i];
+        put_u32(&w, table->columns.count);
+        for (size_t j=0; j<table->columns.count; j++) {
+            fmp_column_t *column = &table->columns.columns[j];
+            put_u32(&w, column->index);
+            put_u32(&w, column->type);
+            put_u32(&w, column->collation);
+            put_name(&w, column->utf8_name);
+        }
+        put_u32(&w, table->counted);
+        put_u64(&w, table->row_count);
+        put_u32(&w, table->mark_count);
+        for (size_t j=0; j<table->mark_count; j++) {
+            fmp_row_mark_t *mark = &table->marks[j];
+            put_u32(&w, mark->block_id);
+            put_u64(&w, mark->row);
+            put_u64(&w, mark->last_row);
+            put_u32(&w, mark->last_column);
+        }
+        put_u32(&w, table->ordered);
+    }
+    put_u64(&w, hash_bytes(0xcbf29ce484222325ULL, w.bytes, w.len));
+    if (w.failed) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+
+    if (!(stream = fopen(temp_path, "wb"))) {
+        retval = FMP_ERROR_WRITE;
+        goto cleanup;
+    }
+    if (fwrite(w.bytes, w.len, 1, stream) != 1)
+        retval = FMP_ERROR_WRITE;
+    if (fclose(stream) != 0)
+        retval = FMP_ERROR_WRITE;
+    if (retval == FMP_OK && rename(temp_path, sidecar) != 0)
+        retval = FMP_ERROR_WRITE;
+    if (retval != FMP_OK)
+        remove(temp_path);
+
+cleanup:
+    free(w.bytes);
+    free(chain);
+    free(temp_path);
+    free(sidecar);
+    return retval;
+}
+
+/* Ranges must point at blocks in the file, and if the chain was saved,
+ * run forward along it; position holds each block's place on the chain,
+ * counting from 1, or is NULL if no chain was saved, in which case the
+ * ranges' places stay unknown */
+static fmp_error_t read_directory(fmp_index_reader_t *r, fmp_file_t *file,
+        const uint32_t *position, fmp_directory_t **directory) {
+    int valid = get_u32(r);
+    size_t count = get_count(r);
+    if (!valid && !count)
+        return FMP_OK;
+    *directory = calloc(1, sizeof(fmp_directory_t));
+    if (!*directory || (count && !((*directory)->roots = calloc(count, sizeof(fmp_block_range_t)))))
+        return FMP_ERROR_MALLOC;
+    (*directory)->valid = valid;
+    (*directory)->count = count;
+    for (size_t i=0; i<count && !r->failed; i++) {
+        fmp_block_range_t *range = &(*directory)->roots[i];
+        range->first_id = get_u32(r);
+        range->last_id = get_u32(r);
+        if (!range->first_id && !range->last_id)
+            continue;
+        if (!range->first_id || range->first_id > file->num_blocks ||
+                !range->last_id || range->last_id > file->num_blocks)
+            r->failed = 1;
+        else if (position && (!position[range->first_id-1] ||
+                    position[range->first_id-1] > position[range->last_id-1]))
+            r->failed = 1;
+        else if (position) {
+            range->first_pos = position[range->first_id-1];
+            range->last_pos = position[range->last_id-1];
+        }
+    }
+    return FMP_OK;
+}
+
+/* Marks must be in row order and point at blocks in the file */
+static fmp_error_t read_marks(fmp_index_reader_t *r, fmp_file_t *file, fmp_table_schema_t *table) {
+    table->mark_count = get_count(r);
+    if (table->mark_count && !(table->marks = calloc(table->mark_count, sizeof(fmp_row_mark_t))))
+        return FMP_ERROR_MALLOC;
+    for (size_t i=0; i<table->mark_count && !r->failed; i++) {
+        fmp_row_mark_t *mark = &table->marks[i];
+        mark->block_id = get_u32(r);
+        mark->row = get_u64(r);
+        mark->last_row = get_u64(r);
+        mark->last_column = get_u32(r);
+        if (mark->block_id == 0 || mark->block_id > file->num_blocks ||
+                mark->row > table->row_count || (i > 0 && mark->row <= table->marks[i-1].row))
+            r->failed = 1;
+    }
+    table->ordered = get_u32(r);
+    return FMP_OK;
+}
+
+static fmp_error_t read_schema(fmp_index_reader_t *r, fmp_file_t *file, fmp_schema_t *schema) {
+    fmp_table_array_t *tables = &schema->tables;
+    tables->count = get_count(r);
+    if (tables->count && !(tables->tables = calloc(tables->count, sizeof(fmp_table_t))))
+        return FMP_ERROR_MALLOC;
+    for (size_t i=0; i<tables->count; i++) {
+        tables->tables[i].index = get_u32(r);
+        get_name(r, tables->tables[i].utf8_name, sizeof(tables->tables[i].utf8_name));
+    }
+    schema->count = get_count(r);
+    if (schema->count && !(schema->by_index = calloc(schema->count, sizeof(fmp_table_schema_t))))
+        return FMP_ERROR_MALLOC;
+    for (size_t i=0; i<schema->count && !r->failed; i++) {
+        fmp_table_schema_t *table = &schema->by_index[i];
+        fmp_column_array_t *columns = &table->columns;
+        columns->count = get_count(r);
+        if (columns->count && !(columns->columns = calloc(columns->count, sizeof(fmp_column_t))))
+            return FMP_ERROR_MALLOC;
+        for (size_t j=0; j<columns->count; j++) {
+            fmp_column_t *column = &columns->columns[j];
+            column->index = get_count(r);
+            column->type = get_u32(r);
+            column->collation = get_u32(r);
+            get_name(r, column->utf8_name, sizeof(column->utf8_name));
+        }
+        table->counted = get_u32(r);
+        table->row_count = get_u64(r);
+        fmp_error_t retval = read_marks(r, file, table);
+        if (retval == FMP_OK)
+            retval = finish_table_schema(table);
+        if (retval != FMP_OK)
+            return retval;
+    }
+    return FMP_OK;
+}
+
+/* Sets up the chain's sector links from the order saved in the index,
+ * and each block's place on the chain, if any was saved */
+static fmp_error_t read_chain(fmp_index_reader_t *r, fmp_file_t *file, uint32_t **sector_next,
+        uint32_t **position) {
+    size_t len = get_count(r);
+    if (len > file->num_blocks) {
+        r->failed = 1;
+        return FMP_OK;
+    }
+    if (!(*sector_next = calloc(file->num_blocks, sizeof(uint32_t))))
+        return FMP_ERROR_MALLOC;
+    if (len && !(*position = calloc(file->num_blocks, sizeof(uint32_t))))
+        return FMP_ERROR_MALLOC;
+    uint32_t prev = 0;
+    for (size_t i=0; i<len; i++) {
+        uint32_t index = get_u32(r);
+        if (index >= file->num_blocks || (*position)[index]) {
+            r->failed = 1;
+            return FMP_OK;
+        }
+        if (i > 0)
+            (*sector_next)[prev] = index + 1;
+        (*position)[index] = i + 1;
+        prev = index;
+    }
+    return FMP_OK;
+}
+
+/* Loads path.fmpidx if it matches the file. Any tables, columns or
+ * directory found there are used from then on; a missing, stale or
+ * damaged index is reported as an error and leaves the file as it was. */
+fmp_error_t load_index(fmp_file_t *file, const char *path) {
+    fmp_error_t retval = FMP_OK;
+    fmp_index_writer_t key = { 0 };
+    fmp_index_reader_t r = { 0 };
+    fmp_index_reader_t trailer = { 0 };
+    uint8_t *bytes = NULL;
+    uint32_t *sector_next = NULL;
+    uint32_t *position = NULL;
+    fmp_directory_t *directory = NULL;
+    fmp_schema_t *schema = NULL;
+    FILE *stream = NULL;
+    char *sidecar = index_path(path);
+    struct stat st, index_st;
+    uint64_t hash = 0;
+    if (!sidecar) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    if (stat(path, &st) == -1 || !(stream = fopen(sidecar, "rb")) ||
+            fstat(fileno(stream), &index_st) == -1) {
+        retval = FMP_ERROR_OPEN;
+        goto cleanup;
+    }
+    if (!(bytes = malloc(index_st.st_size ? index_st.st_size : 1))) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    if (fread(bytes, 1, index_st.st_size, stream) != index_st.st_size) {
+        retval = FMP_ERROR_READ;
+        goto cleanup;
+    }
+    if ((retval = hash_file(file, &hash)) != FMP_OK)
+        goto cleanup;
+    put_key(&key, file, &st, hash);
+    if (key.failed) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    if (index_st.st_size < key.len + 8 || memcmp(bytes, key.bytes, key.len) != 0) {
+        retval = FMP_ERROR_BAD_INDEX;
+        goto cleanup;
+    }
+    r.bytes = bytes;
+    r.len = index_st.st_size - 8;
+    r.pos = key.len;
+    trailer = r;
+    trailer.len = index_st.st_size;
+    trailer.pos = r.len;
+    if (get_u64(&trailer) != hash_bytes(0xcbf29ce484222325ULL, bytes, r.len)) {
+        retval = FMP_ERROR_BAD_INDEX;
+        goto cleanup;
+    }
+
+    if (!(schema = calloc(1, sizeof(fmp_schema_t)))) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    if ((retval = read_chain(&r, file, &sector_next, &position)) != FMP_OK ||
+            (retval = read_directory(&r, file, position, &directory)) != FMP_OK ||
+            (retval = read_schema(&r, file, schema)) != FMP_OK)
+        goto cleanup;
+    if (r.failed || r.pos != r.len) {
+        retval = FMP_ERROR_BAD_INDEX;
+        goto cleanup;
+    }
+
+    if (!file->sector_next) {
+        file->sector_next = sector_next;
+        sector_next = NULL;
+    }
+    if (!file->directory) {
+        file->directory = directory;
+        directory = NULL;
+    }
+    if (!file->schema) {
+        file->schema = schema;
+        schema = NULL;
+    }
+
+cleanup:
+    if (stream)
+        fclose(stream);
+    free(bytes);
+    free(key.bytes);
+    free(sidecar);
+    free(sector_next);
+    free(position);
+    free_directory(directory);
+    free_schema(schema);
+    return retval;
+}
+
+/* Opens the file without its index, so that everything is learned afresh,
+ * and saves what the scans find */
+fmp_error_t fmp_build_index(const char *path) {
+    fmp_open_options_t options = { .skip_index = 1 };
+    fmp_error_t retval = FMP_OK;
+    fmp_file_t *file = fmp_open_file_with_options(path, &options, &retval);
+    if (!file)
+        return retval;
+    if (file->stream_source) {
+        retval = FMP_ERROR_CANNOT_INDEX;
+    } else {
+        retval = write_index(file, path);
+    }
+    fmp_close_file(file);
+    return retval;
+}
@@ -0,0 +1,243 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* Path patterns are compiled into a bit-parallel state machine: bit i of a
+ * mask stands for pattern i. Each push narrows the set of live patterns at
+ * the new depth using the pattern elements for that depth, and a chunk is
+ * handed to the caller only if a pattern that ends at its depth is still
+ * live, so chunks outside every pattern cost one AND. */
+
+#define MAX_PATTERNS 64
+
+typedef struct fmp_path_element_s {
+    uint64_t min;
+    uint64_t max;
+} fmp_path_element_t;
+
+struct fmp_query_s {
+    size_t count;
+    fmp_path_element_t elements[MAX_PATTERNS][FMP_MAX_PATH_DEPTH];
+    /* Patterns whose element at this depth matches any value */
+    uint64_t any_at[FMP_MAX_PATH_DEPTH];
+    /* Patterns that match a chunk whose path has this depth */
+    uint64_t accept[FMP_MAX_PATH_DEPTH+1];
+};
+
+typedef struct fmp_query_ctx_s {
+    fmp_file_t *file;
+    fmp_query_t *query;
+    fmp_chunk_handler handle_chunk;
+    void *user_ctx;
+    uint64_t live[FMP_MAX_PATH_DEPTH+1];
+} fmp_query_ctx_t;
+
+fmp_query_t *fmp_new_query(fmp_error_t *errorCode) {
+    fmp_query_t *query = calloc(1, sizeof(fmp_query_t));
+    if (errorCode)
+        *errorCode = query ? FMP_OK : FMP_ERROR_MALLOC;
+    return query;
+}
+
+static const char *parse_element(const char *p, fmp_path_element_t *element) {
+    if (*p++ != '[')
+        return NULL;
+    element->min = 0;
+    element->max = UINT64_MAX;
+    if (*p == '*')
+        return p[1] == ']' ? p + 2 : NULL;
+    if (*p < '0' || *p > '9')
+        return NULL;
+    char *end = NULL;
+    element->min = strtoull(p, &end, 10);
+    p = end;
+    if (p[0] == '+' && p[1] == '*') {
+        p += 2;
+    } else {
+        element->max = element->min;
+    }
+    return *p == ']' ? p + 1 : NULL;
+}
+
+/* Patterns are dot-separated elements: [N] matches the integer N, [N+*]
+ * anything from N up, and [*] any value. A final * matches any number of
+ * further levels, including none. */
+int fmp_query_add_path(fmp_query_t *query, const char *pattern, fmp_error_t *errorCode) {
+    fmp_path_element_t elements[FMP_MAX_PATH_DEPTH];
+    size_t depth = 0;
+    int open_ended = 0;
+    const char *p = pattern;
+    while (*p) {
+        if (p[0] == '*' && p[1] == '\0') {
+            open_ended = 1;
+            break;
+        }
+        if (depth == FMP_MAX_PATH_DEPTH || !(p = parse_element(p, &elements[depth++])))
+            goto error;
+        if (*p == '.' && p[1] != '\0') {
+            p++;
+        } else if (*p) {
+            goto error;
+        }
+    }
+    if (query->count == MAX_PATTERNS)
+        goto error;
+
+    size_t index = query->count++;
+    uint64_t bit = (uint64_t)1 << index;
+    for (size_t d=0; d<FMP_MAX_PATH_DEPTH; d++) {
+        if (d < depth) {
+            query->elements[index][d] = elements[d];
+            if (elements[d].min == 0 && elements[d].max == UINT64_MAX)
+                query->any_at[d] |= bit;
+        } else if (open_ended) {
+            query->any_at[d] |= bit;
+        } else {
+            query->elements[index][d] = (fmp_path_element_t){ .min = 1, .max = 0 };
+        }
+    }
+    for (size_t d=depth; d<=FMP_MAX_PATH_DEPTH; d++) {
+        if (d == depth || open_ended)
+            query->accept[d] |= bit;
+    }
+    if (errorCode)
+        *errorCode = FMP_OK;
+    return index;
+
+error:
+    if (errorCode)
+        *errorCode = FMP_ERROR_BAD_PATTERN;
+    return -1;
+}
+
+static uint64_t push_value(fmp_query_t *query, uint64_t live, size_t depth, uint64_t value) {
+    uint64_t next = live & query->any_at[depth];
+    uint64_t check = live & ~query->any_at[depth];
+    for (size_t i=0; check; i++, check >>= 1) {
+        fmp_path_element_t *element = &query->elements[i][depth];
+        if ((check & 1) && value >= element->min && value <= element->max)
+            next |= (uint64_t)1 << i;
+    }
+    return next;
+}
+
+static chunk_status_t handle_chunk_query(fmp_chunk_t *chunk, void *ctxp) {
+    fmp_query_ctx_t *ctx = (fmp_query_ctx_t *)ctxp;
+    fmp_query_t *query = ctx->query;
+    size_t level = chunk->path_level;
+    if (chunk->type == FMP_CHUNK_PATH_PUSH) {
+        ctx->live[level+1] = push_value(query, ctx->live[level], level, chunk->path_values[level]);
+        return CHUNK_NEXT;
+    }
+    if (chunk->type == FMP_CHUNK_PATH_POP)
+        return CHUNK_NEXT;
+
+    uint64_t matches = ctx->live[level] & query->accept[level];
+    if (!matches)
+        return CHUNK_NEXT;
+
+    fmp_chunk_t view = *chunk;
+    if (view.type != FMP_CHUNK_DATA_SIMPLE)
+        view.data.bytes = unmask_data(ctx->file, &chunk->data);
+    if (view.type == FMP_CHUNK_FIELD_REF_LONG)
+        view.ref_long.bytes = unmask_data(ctx->file, &chunk->ref_long);
+    for (int i=0; matches; i++, matches >>= 1) {
+        if ((matches & 1) && ctx->handle_chunk(i, &view, ctx->user_ctx) == FMP_HANDLER_ABORT)
+            return CHUNK_ABORT;
+    }
+    return CHUNK_NEXT;
+}
+
+/* The path a pattern's matches are filed under: each exact element, then
+ * a range if it stays within one-byte values. Zero doesn't count, since
+ * strings in paths read as zero but sort anywhere, and nor do wider ranges,
+ * since larger values have encodings that sort among smaller ones. */
+static size_t pattern_path(fmp_query_t *query, size_t index, int end, uint64_t *path) {
+    size_t depth = 0;
+    while (depth < FMP_MAX_PATH_DEPTH) {
+        fmp_path_element_t *element = &query->elements[index][depth];
+        if (element->min == 0 || element->min > element->max)
+            break;
+        if (element->min != element->max && element->max >= 0x80)
+            break;
+        path[depth++] = end ? element->max : element->min;
+        if (element->min != element->max)
+            break;
+    }
+    return depth;
+}
+
+/* Finds the paths where every pattern's matches begin (or end) by widening
+ * one pattern's path to take in the next. A prefix takes in everything
+ * under it; otherwise two paths can be ordered by the first element where
+ * they differ only if both values fit in a byte, and else are cut back to
+ * what they share. Returns 0 if there's no bound on that side. */
+static size_t query_bound(fmp_query_t *query, int end, uint64_t *path) {
+    size_t depth = pattern_path(query, 0, end, path);
+    for (size_t i=1; i<query->count && depth; i++) {
+        uint64_t other[FMP_MAX_PATH_DEPTH];
+        size_t other_depth = pattern_path(query, i, end, other);
+        size_t d = 0;
+        while (d < depth && d < other_depth && path[d] == other[d])
+            d++;
+        if (d == depth || d == other_depth) {
+            depth = d;
+        } else if (path[d] < 0x80 && other[d] < 0x80) {
+            if (end ? other[d] > path[d] : other[d] < path[d]) {
+                memcpy(path, other, other_depth * sizeof(uint64_t));
+                depth = other_depth;
+            }
+        } else {
+            depth = d;
+        }
+    }
+    return depth;
+}
+
+/* In fp3 and fp5 files the B-tree finds where the patterns' paths begin and
+ * end on the chain, so only that stretch is walked */
+fmp_error_t fmp_query_file(fmp_file_t *file, fmp_query_t *query,
+        fmp_chunk_handler handle_chunk, void *user_ctx) {
+    fmp_query_ctx_t ctx = { .file = file, .query = query,
+        .handle_chunk = handle_chunk, .user_ctx = user_ctx };
+    if (!query->count)
+        return FMP_OK;
+    ctx.live[0] = query->count == MAX_PATTERNS ? UINT64_MAX : ((uint64_t)1 << query->count) - 1;
+
+    uint64_t first_path[FMP_MAX_PATH_DEPTH];
+    uint64_t last_path[FMP_MAX_PATH_DEPTH];
+    size_t first_depth = query_bound(query, 0, first_path);
+    size_t last_depth = query_bound(query, 1, last_path);
+    size_t first_id = first_depth ? seek_path(file, first_path, first_depth, 0) : 0;
+    size_t last_id = last_depth ? seek_path(file, last_path, last_depth, 1) : 0;
+    return process_block_range(file, first_id ? first_id : 2, last_id,
+            NULL, handle_chunk_query, &ctx);
+}
+
+void fmp_free_query(fmp_query_t *query) {
+    free(query);
+}
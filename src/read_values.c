@@ -27,6 +27,15 @@
 #include "fmp.h"
 #include "fmp_internal.h"
 
+#define SELECT_OUTPUT   1
+#define SELECT_FILTER   2
+
+typedef struct fmp_held_value_s {
+    fmp_column_t *column;
+    size_t offset;
+    size_t len;
+} fmp_held_value_t;
+
 typedef struct fmp_read_values_ctx_s {
     size_t current_row;
     size_t last_row;
@@ -35,85 +44,243 @@ typedef struct fmp_read_values_ctx_s {
     size_t long_string_used;
     size_t target_table_index;
     size_t last_column;
-    size_t num_columns;
     fmp_file_t *file;
-    fmp_column_t *columns;
+    fmp_table_schema_t *schema; /* columns come from the file's cached schema */
+    fmp_table_stats_t *stats;
     fmp_value_handler handle_value;
     void *user_ctx;
+    uint8_t *selected; /* SELECT_ flags by column index - 1; NULL for all columns */
+    /* With a filter, a row's values are held, as stored, until the row ends
+     * and it's known whether the row meets every condition */
+    fmp_filter_t *filter;
+    uint8_t *seen; /* by condition */
+    uint8_t *matched;
+    fmp_held_value_t *held;
+    size_t held_count;
+    size_t held_capacity;
+    uint8_t *held_bytes;
+    size_t held_bytes_used;
+    size_t held_bytes_len;
+    fmp_error_t error;
+    /* Values from rows before first_row aren't handed over, and the scan
+     * stops before any row after stop_row, unless it's 0. With record_id
+     * set, only that record's values are handed over. */
+    size_t first_row;
+    size_t stop_row;
+    size_t record_id;
+    size_t row_record;
+    int ordered;
+    int found;
+    int marking;
+    size_t mark_count;
+    size_t mark_capacity;
+    fmp_row_mark_t *marks;
 } fmp_read_values_ctx_t;
 
 static int path_is_table_data(fmp_chunk_t *chunk) {
     return table_path_match_start1(chunk, 2, 5);
 }
 
-static int path_row(fmp_chunk_t *chunk) {
+/* Record ids past 0x407F take three bytes. In fp7 and fmp12 files
+ * path_value() keeps only the last two of them, since other paths carry
+ * flags in the first, so a row's id is worked out here. */
+static size_t path_row(fmp_chunk_t *chunk) {
     if (chunk->version_num < 7)
-        return path_value(chunk, chunk->path[1]);
-    return path_value(chunk, chunk->path[2]);
+        return chunk->path_values[1];
+    fmp_data_t *path = chunk->path[2];
+    if (path->len == 3)
+        return 0x4080 + ((path->bytes[0] & 0x3F) << 16) + (path->bytes[1] << 8) + path->bytes[2];
+    return chunk->path_values[2];
 }
 
 static int path_is_long_string(fmp_chunk_t *chunk, fmp_read_values_ctx_t *ctx) {
     if (!table_path_match_start1(chunk, 3, 5))
         return 0;
-    uint64_t column_index = path_value(chunk, chunk->path[chunk->version_num < 7 ? 2 : 3]);
+    uint64_t column_index = chunk->path_values[chunk->version_num < 7 ? 2 : 3];
     if (ctx->last_column == 0 || column_index < ctx->last_column) {
         return path_row(chunk) > ctx->last_row;
     }
     return path_row(chunk) == ctx->last_row;
 }
 
+static int row_wanted(fmp_read_values_ctx_t *ctx) {
+    return ctx->handle_value && ctx->current_row >= ctx->first_row &&
+        (!ctx->record_id || ctx->row_record == ctx->record_id);
+}
+
+static fmp_handler_status_t hand_over(fmp_read_values_ctx_t *ctx, fmp_column_t *column,
+        uint8_t *bytes, size_t len) {
+    char utf8_value[len*4+1];
+    convert(ctx->file->converter, utf8_value, sizeof(utf8_value), bytes, len);
+    return ctx->handle_value(ctx->current_row, column, utf8_value, ctx->user_ctx);
+}
+
+/* Checks a value against the filter's conditions on its column, and keeps
+ * a copy if its column is to be handed over */
+static fmp_handler_status_t hold_value(fmp_read_values_ctx_t *ctx, fmp_column_t *column,
+        uint8_t *bytes, size_t len) {
+    fmp_filter_t *filter = ctx->filter;
+    for (size_t i=0; i<filter->count; i++) {
+        fmp_condition_t *condition = &filter->conditions[i];
+        if (condition->column_index != column->index)
+            continue;
+        ctx->seen[i] = 1;
+        if (!ctx->matched[i] && condition_matches(condition, bytes, len))
+            ctx->matched[i] = 1;
+    }
+    if (ctx->selected && !(ctx->selected[column->index-1] & SELECT_OUTPUT))
+        return FMP_HANDLER_OK;
+    if (ctx->held_count == ctx->held_capacity) {
+        size_t capacity = ctx->held_capacity ? 2 * ctx->held_capacity : 16;
+        fmp_held_value_t *held = realloc(ctx->held, capacity * sizeof(fmp_held_value_t));
+        if (!held)
+            goto error;
+        ctx->held = held;
+        ctx->held_capacity = capacity;
+    }
+    if (ctx->held_bytes_used + len > ctx->held_bytes_len) {
+        size_t capacity = ctx->held_bytes_len ? ctx->held_bytes_len : 1024;
+        while (capacity < ctx->held_bytes_used + len)
+            capacity *= 2;
+        uint8_t *held_bytes = realloc(ctx->held_bytes, capacity);
+        if (!held_bytes)
+            goto error;
+        ctx->held_bytes = held_bytes;
+        ctx->held_bytes_len = capacity;
+    }
+    memcpy(&ctx->held_bytes[ctx->held_bytes_used], bytes, len);
+    ctx->held[ctx->held_count++] = (fmp_held_value_t){ .column = column,
+        .offset = ctx->held_bytes_used, .len = len };
+    ctx->held_bytes_used += len;
+    return FMP_HANDLER_OK;
+
+error:
+    ctx->error = FMP_ERROR_MALLOC;
+    return FMP_HANDLER_ABORT;
+}
+
+/* Ends the current row, handing over what was held of it if it meets every
+ * condition; a condition on a column it had no value for is checked
+ * against "" */
+static fmp_handler_status_t release_row(fmp_read_values_ctx_t *ctx) {
+    fmp_filter_t *filter = ctx->filter;
+    fmp_handler_status_t status = FMP_HANDLER_OK;
+    int pass = 1;
+    for (size_t i=0; i<filter->count; i++) {
+        if (!ctx->seen[i] && condition_matches(&filter->conditions[i], (const uint8_t *)"", 0))
+            ctx->matched[i] = 1;
+        pass = pass && ctx->matched[i];
+    }
+    for (size_t i=0; pass && i<ctx->held_count && status == FMP_HANDLER_OK; i++) {
+        fmp_held_value_t *held = &ctx->held[i];
+        status = hand_over(ctx, held->column, &ctx->held_bytes[held->offset], held->len);
+    }
+    ctx->held_count = 0;
+    ctx->held_bytes_used = 0;
+    memset(ctx->seen, 0, filter->count);
+    memset(ctx->matched, 0, filter->count);
+    return status;
+}
+
+/* Hands a finished value to the statistics being gathered, if any, and to
+ * the value handler, or holds it until its row is known to pass the
+ * filter. Without a handler nothing is converted, and bytes may be NULL. */
+static fmp_handler_status_t emit_value(fmp_read_values_ctx_t *ctx, fmp_column_t *column,
+        uint8_t *bytes, size_t len) {
+    if (ctx->stats) {
+        fmp_column_stats_t *stats = &ctx->stats->columns[column - ctx->schema->columns.columns];
+        stats->value_count++;
+        stats->byte_count += len;
+        ctx->stats->byte_count += len;
+    }
+    if (!row_wanted(ctx))
+        return FMP_HANDLER_OK;
+    if (ctx->filter)
+        return hold_value(ctx, column, bytes, len);
+    return hand_over(ctx, column, bytes, len);
+}
+
+/* Hands over a long string still being gathered when a table ends */
+static fmp_handler_status_t flush_long_string(fmp_read_values_ctx_t *ctx) {
+    fmp_handler_status_t status = FMP_HANDLER_OK;
+    if (ctx->long_string_used) {
+        status = emit_value(ctx, ctx->schema->slots[ctx->last_column-1],
+                ctx->long_string_buf, ctx->long_string_used);
+    }
+    ctx->long_string_used = 0;
+    return status;
+}
+
 static chunk_status_t process_value(fmp_chunk_t *chunk, fmp_read_values_ctx_t *ctx) {
     fmp_column_t *column = NULL;
     int long_string = 0;
     size_t column_index = 0;
+    size_t num_columns = ctx->schema ? ctx->schema->slot_count : 0;
     if (path_is_long_string(chunk, ctx)) {
         if (chunk->type == FMP_CHUNK_FIELD_REF_SIMPLE && chunk->ref_simple == 0)
             return CHUNK_NEXT; /* Rich-text formatting */
         long_string = 1;
-        column_index = path_value(chunk, chunk->path[chunk->path_level-1]);
+        column_index = chunk->path_values[chunk->path_level-1];
     } else if (path_is_table_data(chunk)) {
-        if (chunk->type == FMP_CHUNK_FIELD_REF_SIMPLE && chunk->ref_simple <= ctx->num_columns
+        if (chunk->type == FMP_CHUNK_FIELD_REF_SIMPLE && chunk->ref_simple <= num_columns
                 && chunk->ref_simple != 252 /* Special metadata value? */) {
             column_index = chunk->ref_simple;
-        } else if (chunk->type == FMP_CHUNK_DATA_SEGMENT && chunk->segment_index <= ctx->num_columns) {
+        } else if (chunk->type == FMP_CHUNK_DATA_SEGMENT && chunk->segment_index <= num_columns) {
             column_index = chunk->segment_index;
         }
     }
-    if (column_index == 0 || column_index > ctx->num_columns)
+    if (column_index == 0 || column_index > num_columns)
         return CHUNK_NEXT;
 
-    column = &ctx->columns[column_index-1];
+    column = ctx->schema->slots[column_index-1];
+    if (!column)
+        return CHUNK_NEXT;
 
     if (column->index != ctx->last_column && ctx->long_string_used) {
-        if (ctx->handle_value) {
-            char utf8_value[ctx->long_string_used*4+1];
-            convert(ctx->file->converter, ctx->file->xor_mask,
-                    utf8_value, sizeof(utf8_value), ctx->long_string_buf, ctx->long_string_used);
-            if (ctx->handle_value(ctx->current_row, &ctx->columns[ctx->last_column-1],
-                    utf8_value, ctx->user_ctx) == FMP_HANDLER_ABORT)
-                return CHUNK_ABORT;
-        }
+        if (emit_value(ctx, ctx->schema->slots[ctx->last_column-1],
+                    ctx->long_string_buf, ctx->long_string_used) == FMP_HANDLER_ABORT)
+            return CHUNK_ABORT;
 
         ctx->long_string_used = 0;
     }
     if (path_row(chunk) != ctx->last_row || column->index < ctx->last_column) {
+        if ((ctx->stop_row && ctx->current_row == ctx->stop_row) ||
+                (ctx->record_id && ctx->ordered && path_row(chunk) > ctx->record_id)) {
+            return CHUNK_STOP;
+        }
+        if (ctx->filter && ctx->current_row && (flush_long_string(ctx) == FMP_HANDLER_ABORT ||
+                    release_row(ctx) == FMP_HANDLER_ABORT))
+            return CHUNK_ABORT;
+        if (ctx->current_row && path_row(chunk) < ctx->row_record)
+            ctx->ordered = 0;
         ctx->current_row++;
+        ctx->row_record = path_row(chunk);
+        if (ctx->record_id && ctx->row_record == ctx->record_id)
+            ctx->found = 1;
+    }
+    /* Rows are still followed through columns nobody asked for */
+    if (ctx->selected && !ctx->selected[column_index-1]) {
+        ctx->last_row = path_row(chunk);
+        ctx->last_column = column->index;
+        return CHUNK_NEXT;
     }
     if (long_string) {
-        if (ctx->long_string_buf == NULL ||
-                ctx->long_string_len < ctx->long_string_used + chunk->data.len + 1) {
-            ctx->long_string_len = ctx->long_string_used + chunk->data.len + 1;
-            ctx->long_string_buf = realloc(ctx->long_string_buf, ctx->long_string_len);
+        /* Only the length matters if nothing will be converted */
+        if (row_wanted(ctx)) {
+            if (ctx->long_string_buf == NULL ||
+                    ctx->long_string_len < ctx->long_string_used + chunk->data.len + 1) {
+                ctx->long_string_len = ctx->long_string_used + chunk->data.len + 1;
+                ctx->long_string_buf = realloc(ctx->long_string_buf, ctx->long_string_len);
+            }
+            memcpy(&ctx->long_string_buf[ctx->long_string_used],
+                    unmask_data(ctx->file, &chunk->data), chunk->data.len);
+            ctx->long_string_buf[ctx->long_string_used + chunk->data.len] = '\0';
         }
-        memcpy(&ctx->long_string_buf[ctx->long_string_used], chunk->data.bytes, chunk->data.len);
         ctx->long_string_used += chunk->data.len;
-        ctx->long_string_buf[ctx->long_string_used] = '\0';
-    } else if (ctx->handle_value) {
-        char utf8_value[chunk->data.len*4+1];
-        convert(ctx->file->converter, ctx->file->xor_mask,
-                utf8_value, sizeof(utf8_value), chunk->data.bytes, chunk->data.len);
-        if (ctx->handle_value(ctx->current_row, column, utf8_value, ctx->user_ctx) == FMP_HANDLER_ABORT)
-            return CHUNK_ABORT;
+    } else if (emit_value(ctx, column,
+                row_wanted(ctx) ? unmask_data(ctx->file, &chunk->data) : NULL,
+                chunk->data.len) == FMP_HANDLER_ABORT) {
+        return CHUNK_ABORT;
     }
     ctx->last_row = path_row(chunk);
     ctx->last_column = column->index;
@@ -121,61 +288,31 @@ static chunk_status_t process_value(fmp_chunk_t *chunk, fmp_read_values_ctx_t *c
 }
 
 static chunk_status_t handle_chunk_read_values_v3(fmp_chunk_t *chunk, fmp_read_values_ctx_t *ctx) {
-    if (path_value(chunk, chunk->path[0]) > 5)
-        return CHUNK_DONE;
+    if (chunk->path_values[0] > 5)
+        return stop_scan(ctx->file);
 
     if (chunk->type != FMP_CHUNK_FIELD_REF_SIMPLE)
         return CHUNK_NEXT;
 
-    if (table_path_match_start2(chunk, 3, 3, 5)) {
-        fmp_data_t *column_path = chunk->path[chunk->path_level-1];
-        size_t column_index = path_value(chunk, column_path);
-        if (column_index > ctx->num_columns) {
-            ctx->num_columns = column_index;
-            ctx->columns = realloc(ctx->columns, ctx->num_columns * sizeof(fmp_column_t));
-        }
-        fmp_column_t *current_column = ctx->columns + column_index - 1;
-        if (chunk->ref_simple == 1) {
-            convert(ctx->file->converter, ctx->file->xor_mask,
-                    current_column->utf8_name, sizeof(current_column->utf8_name),
-                    chunk->data.bytes, chunk->data.len);
-            current_column->index = column_index;
-        } else if (chunk->ref_simple == 2) {
-            if (chunk->data.bytes[1] <= FMP_COLUMN_TYPE_GLOBAL) {
-                current_column->type = chunk->data.bytes[1];
-            } else {
-                current_column->type = FMP_COLUMN_TYPE_UNKNOWN;
-            }
-        }
+    if (table_path_match_start2(chunk, 3, 3, 5))
         return CHUNK_NEXT;
-    }
+
     return process_value(chunk, ctx);
 }
 
+/* Chunks under a table's root but outside [3] and [5] can turn up again
+ * near the end of the chain, after later tables', so getting past the
+ * root only ends the block; the directory bounds the scan instead */
 static chunk_status_t handle_chunk_read_values_v7(fmp_chunk_t *chunk, fmp_read_values_ctx_t *ctx) {
-    if (path_value(chunk, chunk->path[0]) > ctx->target_table_index + 128)
+    if (chunk->path_values[0] > ctx->target_table_index + 128)
         return CHUNK_DONE;
-    if (path_value(chunk, chunk->path[0]) < ctx->target_table_index + 128)
+    if (chunk->path_values[0] < ctx->target_table_index + 128)
         return CHUNK_NEXT;
     if (chunk->type != FMP_CHUNK_FIELD_REF_SIMPLE && chunk->type != FMP_CHUNK_DATA_SEGMENT)
         return CHUNK_NEXT;
 
-    if (table_path_match_start2(chunk, 3, 3, 5)) {
-        fmp_data_t *column_path = chunk->path[chunk->path_level-1];
-        size_t column_index = path_value(chunk, column_path);
-        if (column_index > ctx->num_columns) {
-            ctx->num_columns = column_index;
-            ctx->columns = realloc(ctx->columns, ctx->num_columns * sizeof(fmp_column_t));
-        }
-        fmp_column_t *current_column = ctx->columns + column_index - 1;
-        if (chunk->ref_simple == 16) {
-            convert(ctx->file->converter, ctx->file->xor_mask,
-                    current_column->utf8_name, sizeof(current_column->utf8_name),
-                    chunk->data.bytes, chunk->data.len);
-            current_column->index = column_index;
-        }
+    if (table_path_match_start2(chunk, 3, 3, 5))
         return CHUNK_NEXT;
-    }
 
     return process_value(chunk, ctx);
 }
@@ -186,23 +323,459 @@ static chunk_status_t handle_chunk_read_values(fmp_chunk_t *chunk, void *ctx) {
     return handle_chunk_read_values_v3(chunk, ctx);
 }
 
+/* A scan from the start of a table notes where it stands at each block
+ * that some row has begun before, so that later reads of a few rows, or of
+ * one record, deep in the table can begin a block or so short of them */
+static int handle_block_read_values(fmp_block_t *block, void *ctxp) {
+    fmp_read_values_ctx_t *ctx = (fmp_read_values_ctx_t *)ctxp;
+    if (!ctx->marking)
+        return 1;
+    size_t last_mark_row = ctx->mark_count ? ctx->marks[ctx->mark_count-1].row : 0;
+    if (ctx->current_row <= last_mark_row)
+        return 1;
+    if (ctx->mark_count == ctx->mark_capacity) {
+        size_t capacity = ctx->mark_capacity ? 2 * ctx->mark_capacity : 64;
+        fmp_row_mark_t *marks = realloc(ctx->marks, capacity * sizeof(fmp_row_mark_t));
+        if (!marks) {
+            /* Reads of row ranges will just start further back */
+            ctx->marking = 0;
+            return 1;
+        }
+        ctx->marks = marks;
+        ctx->mark_capacity = capacity;
+    }
+    ctx->marks[ctx->mark_count++] = (fmp_row_mark_t){ .block_id = block->this_id,
+        .row = ctx->current_row, .last_row = ctx->last_row, .last_column = ctx->last_column };
+    return 1;
+}
+
+/* Runs a table's values through the context's handler and stats, either
+ * of which may be NULL, from its start or from the given mark. A scan of
+ * the whole table that completes notes its row count, and where each
+ * stretch of rows begins, in the table's schema. */
+static fmp_error_t scan_table(fmp_read_values_ctx_t *ctx, const fmp_row_mark_t *mark) {
+    fmp_table_schema_t *schema = ctx->schema;
+    int whole = !mark && !ctx->stop_row && !ctx->record_id;
+    size_t first_id = 0;
+    if (mark) {
+        first_id = mark->block_id;
+        ctx->current_row = mark->row;
+        ctx->row_record = mark->last_row;
+        ctx->last_row = mark->last_row;
+        ctx->last_column = mark->last_column;
+    }
+    ctx->marking = whole && !schema->counted;
+    if (ctx->marking)
+        ctx->ordered = 1;
+    fmp_error_t retval = process_table_blocks_from(ctx->file, ctx->target_table_index, first_id,
+            handle_block_read_values, handle_chunk_read_values, ctx);
+    if (ctx->error != FMP_OK)
+        retval = ctx->error;
+    fmp_handler_status_t status = flush_long_string(ctx);
+    if (ctx->filter && ctx->current_row && status == FMP_HANDLER_OK && retval == FMP_OK) {
+        if ((status = release_row(ctx)) == FMP_HANDLER_ABORT)
+            retval = ctx->error != FMP_OK ? ctx->error : FMP_ERROR_USER_ABORTED;
+    }
+    if (status == FMP_HANDLER_OK && retval == FMP_OK && whole) {
+        schema->row_count = ctx->current_row;
+        if (ctx->marking) {
+            free(schema->marks);
+            schema->marks = ctx->marks;
+            schema->mark_count = ctx->mark_count;
+            schema->ordered = ctx->ordered;
+            ctx->marks = NULL;
+        }
+        schema->counted = 1;
+    }
+    free(ctx->marks);
+    free(ctx->long_string_buf);
+    free(ctx->held);
+    free(ctx->held_bytes);
+    return retval;
+}
+
 fmp_error_t fmp_read_values(fmp_file_t *file, fmp_table_t *table, fmp_value_handler handle_value, void *user_ctx) {
-    fmp_read_values_ctx_t *ctx = calloc(1, sizeof(fmp_read_values_ctx_t));
-    ctx->target_table_index = table->index;
-    ctx->handle_value = handle_value;
+    fmp_error_t retval = load_schema(file);
+    if (retval != FMP_OK)
+        return retval;
+    fmp_table_schema_t *schema = table_schema(file, table->index);
+    if (!schema || !schema->columns.count)
+        return FMP_OK;
+    fmp_read_values_ctx_t ctx = { .target_table_index = table->index, .file = file,
+        .schema = schema, .handle_value = handle_value, .user_ctx = user_ctx };
+    return scan_table(&ctx, NULL);
+}
+
+fmp_error_t fmp_read_values_where(fmp_file_t *file, fmp_table_t *table,
+        fmp_column_array_t *columns, fmp_filter_t *filter, fmp_value_handler handle_value, void *user_ctx) {
+    fmp_error_t retval = load_schema(file);
+    if (retval != FMP_OK)
+        return retval;
+    fmp_table_schema_t *schema = table_schema(file, table->index);
+    if (!schema || !schema->columns.count)
+        return FMP_OK;
+    if (filter && !filter->count)
+        filter = NULL;
+    fmp_read_values_ctx_t ctx = { .target_table_index = table->index, .file = file,
+        .schema = schema, .handle_value = handle_value, .user_ctx = user_ctx, .filter = filter };
+    int any = !columns;
+    if (columns || filter) {
+        if (!(ctx.selected = calloc(schema->slot_count, sizeof(uint8_t)))) {
+            retval = FMP_ERROR_MALLOC;
+            goto cleanup;
+        }
+    }
+    for (size_t i=0; columns && i<columns->count; i++) {
+        size_t index = columns->columns[i].index;
+        if (index > 0 && index <= schema->slot_count && schema->slots[index-1]) {
+            ctx.selected[index-1] |= SELECT_OUTPUT;
+            any = 1;
+        }
+    }
+    for (size_t i=0; !columns && filter && i<schema->slot_count; i++) {
+        if (schema->slots[i])
+            ctx.selected[i] |= SELECT_OUTPUT;
+    }
+    if (filter) {
+        if (!(ctx.seen = calloc(filter->count, sizeof(uint8_t))) ||
+                !(ctx.matched = calloc(filter->count, sizeof(uint8_t)))) {
+            retval = FMP_ERROR_MALLOC;
+            goto cleanup;
+        }
+        for (size_t i=0; i<filter->count; i++) {
+            size_t index = filter->conditions[i].column_index;
+            if (index > 0 && index <= schema->slot_count)
+                ctx.selected[index-1] |= SELECT_FILTER;
+        }
+    }
+    if (any)
+        retval = scan_table(&ctx, NULL);
+
+cleanup:
+    free(ctx.selected);
+    free(ctx.seen);
+    free(ctx.matched);
+    return retval;
+}
+
+fmp_error_t fmp_read_values_with_columns(fmp_file_t *file, fmp_table_t *table,
+        fmp_column_array_t *columns, fmp_value_handler handle_value, void *user_ctx) {
+    return fmp_read_values_where(file, table, columns, NULL, handle_value, user_ctx);
+}
+
+fmp_error_t fmp_count_rows(fmp_file_t *file, fmp_table_t *table, size_t *count) {
+    fmp_error_t retval = load_schema(file);
+    if (retval != FMP_OK)
+        return retval;
+    fmp_table_schema_t *schema = table_schema(file, table->index);
+    if (schema && schema->columns.count && !schema->counted)
+        retval = fmp_read_values(file, table, NULL, NULL);
+    if (count)
+        *count = schema ? schema->row_count : 0;
+    return retval;
+}
+
+/* The last mark before the given row begins, or NULL if there's none */
+static const fmp_row_mark_t *find_mark(fmp_table_schema_t *schema, size_t row) {
+    size_t lo = 0, hi = schema->mark_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (schema->marks[mid].row < row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &schema->marks[lo-1] : NULL;
+}
+
+fmp_error_t fmp_read_rows(fmp_file_t *file, fmp_table_t *table, size_t first_row, size_t count,
+        fmp_value_handler handle_value, void *user_ctx) {
+    size_t row_count = 0;
+    fmp_error_t retval = fmp_count_rows(file, table, &row_count);
+    if (retval != FMP_OK)
+        return retval;
+    fmp_table_schema_t *schema = table_schema(file, table->index);
+    if (first_row == 0)
+        first_row = 1;
+    if (!schema || !schema->columns.count || count == 0 || first_row > row_count)
+        return FMP_OK;
+    if (count > row_count - first_row + 1)
+        count = row_count - first_row + 1;
+    fmp_read_values_ctx_t ctx = { .target_table_index = table->index, .file = file,
+        .schema = schema, .handle_value = handle_value, .user_ctx = user_ctx,
+        .first_row = first_row, .stop_row = first_row + count - 1 };
+    return scan_table(&ctx, find_mark(schema, first_row));
+}
+
+/* The last mark before any of the record's values, or NULL if there's
+ * none. Records are filed in order of their ids, so in a table whose rows
+ * came in that order the rows' paths rise with the marks. */
+static const fmp_row_mark_t *find_record_mark(fmp_table_schema_t *schema, size_t record_id) {
+    size_t lo = 0, hi = schema->mark_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (schema->marks[mid].last_row < record_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &schema->marks[lo-1] : NULL;
+}
+
+fmp_error_t fmp_get_record(fmp_file_t *file, fmp_table_t *table, size_t record_id,
+        fmp_value_handler handle_value, void *user_ctx) {
+    size_t row_count = 0;
+    fmp_error_t retval = fmp_count_rows(file, table, &row_count);
+    if (retval != FMP_OK)
+        return retval;
+    fmp_table_schema_t *schema = table_schema(file, table->index);
+    if (!schema || !schema->columns.count || record_id == 0)
+        return FMP_ERROR_NO_SUCH_RECORD;
+    fmp_read_values_ctx_t ctx = { .target_table_index = table->index, .file = file,
+        .schema = schema, .handle_value = handle_value, .user_ctx = user_ctx,
+        .record_id = record_id, .ordered = schema->ordered };
+    /* Otherwise the chain was out of order, and the record could be anywhere */
+    retval = scan_table(&ctx, schema->ordered ? find_record_mark(schema, record_id) : NULL);
+    if (retval == FMP_OK && !ctx.found)
+        retval = FMP_ERROR_NO_SUCH_RECORD;
+    return retval;
+}
+
+fmp_table_stats_t *fmp_table_stats(fmp_file_t *file, fmp_table_t *table, fmp_error_t *errorCode) {
+    fmp_table_stats_t *stats = NULL;
+    fmp_table_schema_t *schema = NULL;
+    fmp_error_t retval = load_schema(file);
+    if (retval != FMP_OK)
+        goto cleanup;
+    if (!(stats = calloc(1, sizeof(fmp_table_stats_t)))) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    schema = table_schema(file, table->index);
+    if (!schema || !schema->columns.count)
+        goto cleanup;
+    if (!(stats->columns = calloc(schema->columns.count, sizeof(fmp_column_stats_t)))) {
+        retval = FMP_ERROR_MALLOC;
+        goto cleanup;
+    }
+    stats->count = schema->columns.count;
+    for (size_t i=0; i<stats->count; i++)
+        stats->columns[i].column = schema->columns.columns[i];
+    fmp_read_values_ctx_t ctx = { .target_table_index = table->index, .file = file,
+        .schema = schema, .stats = stats };
+    if ((retval = scan_table(&ctx, NULL)) == FMP_OK)
+        stats->row_count = schema->row_count;
+
+cleanup:
+    if (errorCode)
+        *errorCode = retval;
+    if (retval != FMP_OK) {
+        fmp_free_table_stats(stats);
+        return NULL;
+    }
+    return stats;
+}
+
+void fmp_free_table_stats(fmp_table_stats_t *stats) {
+    if (stats) {
+        free(stats->columns);
+        free(stats);
+    }
+}
+
+/* Each table's columns and records sit in one stretch of the chain, in
+ * table order, so one pass can read the tables in turn: the chunks under
+ * each table's root go through the same handler fmp_read_values uses, and
+ * the table is announced with its columns from the schema just before its
+ * first value. Other parts of a table, like its metadata under [7], can
+ * turn up again after later tables and are passed over. Whether the
+ * columns and records really are in order is settled from the directory
+ * before anything is handed over; if they aren't, or the chain's links
+ * don't hold together, each table is read from its own stretch instead,
+ * as is the single table of older files. Tables are taken in index order
+ * whatever order they were passed in. */
+typedef struct fmp_read_all_values_ctx_s {
+    fmp_file_t *file;
+    fmp_table_t **order;
+    size_t count;
+    size_t next_table;
+    uint64_t root;
+    int per_table;
+    fmp_table_t *table;
+    int announced;
+    fmp_column_array_t no_columns;
+    fmp_read_values_ctx_t values;
+    fmp_table_handler handle_table;
+    fmp_table_value_handler handle_value;
+    void *user_ctx;
+    fmp_error_t error;
+} fmp_read_all_values_ctx_t;
+
+static fmp_handler_status_t announce_table(fmp_read_all_values_ctx_t *ctx) {
+    if (ctx->announced)
+        return FMP_HANDLER_OK;
+    ctx->announced = 1;
+    if (!ctx->handle_table)
+        return FMP_HANDLER_OK;
+    fmp_table_schema_t *schema = ctx->values.schema;
+    return ctx->handle_table(ctx->table, schema ? &schema->columns : &ctx->no_columns, ctx->user_ctx);
+}
+
+static fmp_handler_status_t handle_value_all(int row, fmp_column_t *column, const char *value, void *ctxp) {
+    fmp_read_all_values_ctx_t *ctx = (fmp_read_all_values_ctx_t *)ctxp;
+    if (announce_table(ctx) == FMP_HANDLER_ABORT)
+        return FMP_HANDLER_ABORT;
+    if (!ctx->handle_value)
+        return FMP_HANDLER_OK;
+    return ctx->handle_value(ctx->table, row, column, value, ctx->user_ctx);
+}
+
+static void start_table(fmp_read_all_values_ctx_t *ctx, fmp_table_t *table) {
+    ctx->table = table;
+    ctx->announced = 0;
+    ctx->values = (fmp_read_values_ctx_t){
+        .target_table_index = table->index, .file = ctx->file,
+        .schema = table_schema(ctx->file, table->index),
+        .handle_value = handle_value_all, .user_ctx = ctx };
+}
+
+/* Ends the current table, announcing it if it had no values. With
+ * announce unset, as after an error, nothing more is handed over. */
+static fmp_handler_status_t finish_table(fmp_read_all_values_ctx_t *ctx, int announce) {
+    fmp_handler_status_t status = FMP_HANDLER_OK;
+    if (!ctx->table)
+        return status;
+    if (announce)
+        status = flush_long_string(&ctx->values);
+    if (announce && status == FMP_HANDLER_OK)
+        status = announce_table(ctx);
+    free(ctx->values.long_string_buf);
+    ctx->table = NULL;
+    return status;
+}
+
+/* Starts the table with the given index, if it was asked for, after
+ * announcing any asked-for tables before it, which have no chunks */
+static fmp_handler_status_t seek_table(fmp_read_all_values_ctx_t *ctx, size_t table_index) {
+    while (ctx->next_table < ctx->count) {
+        fmp_table_t *table = ctx->order[ctx->next_table];
+        if (table->index > table_index)
+            break;
+        ctx->next_table++;
+        start_table(ctx, table);
+        if (table->index == table_index)
+            break;
+        if (finish_table(ctx, 1) == FMP_HANDLER_ABORT)
+            return FMP_HANDLER_ABORT;
+    }
+    return FMP_HANDLER_OK;
+}
+
+/* Columns or records under a table the pass has already gone by matter
+ * only if the table was asked for. The directory rules this out between
+ * blocks, so it could only happen within one. */
+static chunk_status_t handle_late_chunk(fmp_read_all_values_ctx_t *ctx, fmp_chunk_t *chunk) {
+    for (size_t i=0; i<ctx->next_table; i++) {
+        if (ctx->order[i]->index == chunk->path_values[0] - 128) {
+            ctx->error = FMP_ERROR_OUT_OF_ORDER;
+            return CHUNK_ABORT;
+        }
+    }
+    return CHUNK_NEXT;
+}
+
+static chunk_status_t handle_chunk_read_all_values(fmp_chunk_t *chunk, void *ctxp) {
+    fmp_read_all_values_ctx_t *ctx = (fmp_read_all_values_ctx_t *)ctxp;
+    if (!ctx->per_table) {
+        uint64_t root = chunk->path_values[0];
+        if (root < 128 || (root != ctx->root && !path_is_table_part(chunk)))
+            return CHUNK_NEXT;
+        if (root < ctx->root)
+            return handle_late_chunk(ctx, chunk);
+        if (root != ctx->root) {
+            ctx->root = root;
+            if (finish_table(ctx, 1) == FMP_HANDLER_ABORT ||
+                    seek_table(ctx, root - 128) == FMP_HANDLER_ABORT)
+                return CHUNK_ABORT;
+        }
+    }
+    if (!ctx->table)
+        return CHUNK_NEXT;
+    return handle_chunk_read_values(chunk, &ctx->values);
+}
+
+static int compare_table_index(const void *a, const void *b) {
+    size_t index_a = (*(fmp_table_t * const *)a)->index;
+    size_t index_b = (*(fmp_table_t * const *)b)->index;
+    return (index_a > index_b) - (index_a < index_b);
+}
+
+/* True if no asked-for table's columns and records reach past the start of
+ * a later table's on the chain. A block where one table ends and the next
+ * begins is fine, since chunks within a block come in order. */
+static int tables_in_chain_order(fmp_read_all_values_ctx_t *ctx) {
+    fmp_directory_t *directory = ctx->file->directory;
+    if (!directory || !directory->valid || !chain_is_linked(ctx->file))
+        return 0;
+    uint32_t later_first = UINT32_MAX;
+    size_t next = ctx->count;
+    for (size_t root = directory->count; root-- > 128; ) {
+        fmp_block_range_t *range = &directory->roots[root];
+        if (!range->first_id)
+            continue;
+        if (!range->first_pos)
+            return 0;
+        while (next && ctx->order[next-1]->index + 128 > root)
+            next--;
+        if (next && ctx->order[next-1]->index + 128 == root && range->last_pos > later_first)
+            return 0;
+        if (range->first_pos < later_first)
+            later_first = range->first_pos;
+    }
+    return 1;
+}
+
+fmp_error_t fmp_read_all_values(fmp_file_t *file, fmp_table_array_t *tables,
+        fmp_table_handler handle_table, fmp_table_value_handler handle_value, void *user_ctx) {
+    fmp_error_t retval = load_schema(file);
+    if (retval != FMP_OK)
+        return retval;
+    fmp_read_all_values_ctx_t *ctx = calloc(1, sizeof(fmp_read_all_values_ctx_t));
+    if (!ctx)
+        return FMP_ERROR_MALLOC;
+    if (tables->count && !(ctx->order = malloc(tables->count * sizeof(fmp_table_t *)))) {
+        free(ctx);
+        return FMP_ERROR_MALLOC;
+    }
+    for (size_t i=0; i<tables->count; i++)
+        ctx->order[i] = &tables->tables[i];
+    qsort(ctx->order, tables->count, sizeof(fmp_table_t *), compare_table_index);
+    ctx->count = tables->count;
     ctx->file = file;
+    ctx->handle_table = handle_table;
+    ctx->handle_value = handle_value;
     ctx->user_ctx = user_ctx;
-    fmp_error_t retval = process_blocks(file, NULL, handle_chunk_read_values, ctx);
-    if (ctx->long_string_used && ctx->handle_value) {
-        char utf8_value[ctx->long_string_used*4+1];
-        convert(ctx->file->converter, ctx->file->xor_mask,
-                utf8_value, sizeof(utf8_value), ctx->long_string_buf, ctx->long_string_used);
-        ctx->handle_value(ctx->current_row, &ctx->columns[ctx->last_column-1],
-                utf8_value, user_ctx);
-        ctx->long_string_used = 0;
+    if (file->version_num >= 7 && tables_in_chain_order(ctx)) {
+        retval = process_blocks(file, NULL, handle_chunk_read_all_values, ctx);
+        if (ctx->error != FMP_OK)
+            retval = ctx->error;
+        if (finish_table(ctx, retval == FMP_OK) == FMP_HANDLER_ABORT ||
+                (retval == FMP_OK && seek_table(ctx, SIZE_MAX) == FMP_HANDLER_ABORT))
+            retval = FMP_ERROR_USER_ABORTED;
+    } else {
+        ctx->per_table = 1;
+        while (retval == FMP_OK && ctx->next_table < ctx->count) {
+            if (seek_table(ctx, ctx->order[ctx->next_table]->index) == FMP_HANDLER_ABORT) {
+                retval = FMP_ERROR_USER_ABORTED;
+                break;
+            }
+            retval = process_table_blocks(file, ctx->table->index, handle_chunk_read_all_values, ctx);
+            if (finish_table(ctx, retval == FMP_OK) == FMP_HANDLER_ABORT)
+                retval = FMP_ERROR_USER_ABORTED;
+        }
     }
-    free(ctx->long_string_buf);
-    free(ctx->columns);
+    finish_table(ctx, 0);
+    free(ctx->order);
     free(ctx);
     return retval;
 }
@@ -0,0 +1,247 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 600 /* pread */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_LIBURING_H
+#include <liburing.h>
+#endif
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* Asynchronous sector reads for the cache. io_uring is used when liburing
+ * was found at build time and the running kernel accepts it; otherwise a
+ * small pool of threads calls pread(). With neither, requests complete
+ * synchronously at submission. */
+
+#define READAHEAD_THREADS 4
+
+struct fmp_readahead_s {
+    int fd;
+#ifdef HAVE_LIBURING_H
+    int use_uring;
+    size_t depth;
+    size_t in_flight;
+    struct io_uring ring;
+#endif
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    fmp_read_request_t *head;
+    fmp_read_request_t *tail;
+    int stopping;
+    size_t num_threads;
+    pthread_t threads[READAHEAD_THREADS];
+#endif
+};
+
+static void complete_request(fmp_readahead_t *ra, fmp_read_request_t *request) {
+    request->status = pread_fully(ra->fd, request->buf, request->len, request->offset) ?
+        FMP_READ_DONE : FMP_READ_FAILED;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *read_worker(void *arg) {
+    fmp_readahead_t *ra = (fmp_readahead_t *)arg;
+    pthread_mutex_lock(&ra->lock);
+    while (1) {
+        while (!ra->head && !ra->stopping)
+            pthread_cond_wait(&ra->work, &ra->lock);
+        if (!ra->head)
+            break;
+        fmp_read_request_t *request = ra->head;
+        ra->head = request->next;
+        if (!ra->head)
+            ra->tail = NULL;
+        pthread_mutex_unlock(&ra->lock);
+
+        int ok = pread_fully(ra->fd, request->buf, request->len, request->offset);
+
+        pthread_mutex_lock(&ra->lock);
+        request->status = ok ? FMP_READ_DONE : FMP_READ_FAILED;
+        pthread_cond_broadcast(&ra->done);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+#endif
+
+#ifdef HAVE_LIBURING_H
+static int reap_one(fmp_readahead_t *ra) {
+    struct io_uring_cqe *cqe = NULL;
+    int rc = 0;
+    while ((rc = io_uring_wait_cqe(&ra->ring, &cqe)) == -EINTR)
+        ;
+    if (rc < 0)
+        return rc;
+    fmp_read_request_t *request = io_uring_cqe_get_data(cqe);
+    if (cqe->res == request->len) {
+        request->status = FMP_READ_DONE;
+    } else {
+        /* Short read or an opcode the kernel doesn't know; finish by hand */
+        complete_request(ra, request);
+    }
+    io_uring_cqe_seen(&ra->ring, cqe);
+    ra->in_flight--;
+    return 0;
+}
+#endif
+
+static void start_workers(fmp_readahead_t *ra, size_t depth) {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->work, NULL);
+    pthread_cond_init(&ra->done, NULL);
+    while (ra->num_threads < READAHEAD_THREADS && ra->num_threads < depth) {
+        if (pthread_create(&ra->threads[ra->num_threads], NULL, read_worker, ra) != 0)
+            break;
+        ra->num_threads++;
+    }
+#endif
+}
+
+#ifdef HAVE_LIBURING_H
+/* A prepared SQE can't be taken back once io_uring_get_sqe() has handed it
+ * out, and the kernel would read into its buffer whenever the ring is next
+ * submitted. So a failed submit turns it into a no-op, waits for the reads
+ * that did go out, and gives up on the ring for the threads. */
+static void abandon_uring(fmp_readahead_t *ra, struct io_uring_sqe *sqe) {
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, NULL);
+    while (ra->in_flight && reap_one(ra) == 0)
+        ;
+    io_uring_queue_exit(&ra->ring);
+    ra->use_uring = 0;
+    start_workers(ra, ra->depth);
+}
+#endif
+
+fmp_readahead_t *new_readahead(int fd, size_t depth) {
+    fmp_readahead_t *ra = calloc(1, sizeof(fmp_readahead_t));
+    if (!ra)
+        return NULL;
+    ra->fd = fd;
+#ifdef HAVE_LIBURING_H
+    if (io_uring_queue_init(depth, &ra->ring, 0) == 0) {
+        ra->use_uring = 1;
+        ra->depth = depth;
+        return ra;
+    }
+#endif
+    start_workers(ra, depth);
+    return ra;
+}
+
+void readahead_submit(fmp_readahead_t *ra, fmp_read_request_t *request) {
+    request->status = FMP_READ_PENDING;
+    request->next = NULL;
+#ifdef HAVE_LIBURING_H
+    if (ra->use_uring) {
+        struct io_uring_sqe *sqe = NULL;
+        while (!(sqe = io_uring_get_sqe(&ra->ring)) && ra->in_flight && reap_one(ra) == 0)
+            ;
+        if (!sqe) {
+            complete_request(ra, request);
+            return;
+        }
+        io_uring_prep_read(sqe, ra->fd, request->buf, request->len, request->offset);
+        io_uring_sqe_set_data(sqe, request);
+        int rc = 0;
+        while ((rc = io_uring_submit(&ra->ring)) == -EINTR ||
+                ((rc == -EAGAIN || rc == -EBUSY) && ra->in_flight && reap_one(ra) == 0))
+            ;
+        if (rc == 1) {
+            ra->in_flight++;
+            return;
+        }
+        abandon_uring(ra, sqe);
+    }
+#endif
+#ifdef HAVE_PTHREAD_H
+    if (ra->num_threads) {
+        pthread_mutex_lock(&ra->lock);
+        if (ra->tail)
+            ra->tail->next = request;
+        else
+            ra->head = request;
+        ra->tail = request;
+        pthread_cond_signal(&ra->work);
+        pthread_mutex_unlock(&ra->lock);
+        return;
+    }
+#endif
+    complete_request(ra, request);
+}
+
+void readahead_wait(fmp_readahead_t *ra, fmp_read_request_t *request) {
+#ifdef HAVE_LIBURING_H
+    if (ra->use_uring) {
+        while (request->status == FMP_READ_PENDING && ra->in_flight && reap_one(ra) == 0)
+            ;
+        if (request->status == FMP_READ_PENDING)
+            request->status = FMP_READ_FAILED;
+        return;
+    }
+#endif
+#ifdef HAVE_PTHREAD_H
+    if (ra->num_threads) {
+        pthread_mutex_lock(&ra->lock);
+        while (request->status == FMP_READ_PENDING)
+            pthread_cond_wait(&ra->done, &ra->lock);
+        pthread_mutex_unlock(&ra->lock);
+    }
+#endif
+}
+
+/* Waits for every outstanding read, since they target the cache's buffers */
+void free_readahead(fmp_readahead_t *ra) {
+#ifdef HAVE_LIBURING_H
+    if (ra->use_uring) {
+        while (ra->in_flight && reap_one(ra) == 0)
+            ;
+        io_uring_queue_exit(&ra->ring);
+        free(ra);
+        return;
+    }
+#endif
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&ra->lock);
+    ra->stopping = 1;
+    pthread_cond_broadcast(&ra->work);
+    pthread_mutex_unlock(&ra->lock);
+    for (int i=0; i<ra->num_threads; i++)
+        pthread_join(ra->threads[i], NULL);
+    pthread_cond_destroy(&ra->done);
+    pthread_cond_destroy(&ra->work);
+    pthread_mutex_destroy(&ra->lock);
+#endif
+    free(ra);
+}
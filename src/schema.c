@@ -0,0 +1,313 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* A file's tables and their columns are gathered in one scan the first time
+ * any of them is asked for, and kept on the file handle until it's closed,
+ * so columns handed to value handlers stay put between calls. In fp7 and
+ * fmp12 files the table catalog is under [3].[16].[5] and each table's
+ * columns are under [128+X].[3].[5]; the scan builds the directory at the
+ * same time, if it hasn't been built already. fp3 and fp5 files hold one
+ * table, named after the file, with its columns under [3].[5]. Listing the
+ * tables alone doesn't need that scan; see load_tables. */
+
+typedef struct fmp_schema_ctx_s {
+    fmp_file_t *file;
+    fmp_schema_t *schema;
+    fmp_error_t error;
+} fmp_schema_ctx_t;
+
+static fmp_table_schema_t *table_slot(fmp_schema_ctx_t *ctx, size_t table_index) {
+    fmp_schema_t *schema = ctx->schema;
+    if (table_index > schema->count) {
+        fmp_table_schema_t *tables = realloc(schema->by_index, table_index * sizeof(fmp_table_schema_t));
+        if (!tables) {
+            ctx->error = FMP_ERROR_MALLOC;
+            return NULL;
+        }
+        memset(&tables[schema->count], 0, (table_index - schema->count) * sizeof(fmp_table_schema_t));
+        schema->by_index = tables;
+        schema->count = table_index;
+    }
+    return &schema->by_index[table_index-1];
+}
+
+/* Returns the column slot for column_index, growing the table's columns,
+ * which are kept by column number until the scan is over */
+static fmp_column_t *column_slot(fmp_schema_ctx_t *ctx, size_t table_index, size_t column_index) {
+    fmp_table_schema_t *table = table_slot(ctx, table_index);
+    if (!table)
+        return NULL;
+    fmp_column_array_t *array = &table->columns;
+    if (column_index > array->count) {
+        fmp_column_t *columns = realloc(array->columns, column_index * sizeof(fmp_column_t));
+        if (!columns) {
+            ctx->error = FMP_ERROR_MALLOC;
+            return NULL;
+        }
+        memset(&columns[array->count], 0, (column_index - array->count) * sizeof(fmp_column_t));
+        array->columns = columns;
+        array->count = column_index;
+    }
+    return &array->columns[column_index-1];
+}
+
+static chunk_status_t handle_column(fmp_schema_ctx_t *ctx, size_t table_index,
+        size_t column_index, fmp_data_t *name) {
+    if (table_index == 0 || column_index == 0)
+        return CHUNK_NEXT;
+    fmp_column_t *column = column_slot(ctx, table_index, column_index);
+    if (!column)
+        return CHUNK_ABORT;
+    convert(ctx->file->converter,
+            column->utf8_name, sizeof(column->utf8_name),
+            unmask_data(ctx->file, name), name->len);
+    column->index = column_index;
+    return CHUNK_NEXT;
+}
+
+static chunk_status_t handle_table(fmp_schema_ctx_t *ctx, size_t table_index, fmp_data_t *name) {
+    fmp_table_array_t *array = &ctx->schema->tables;
+    if (table_index == 0)
+        return CHUNK_NEXT;
+    if (table_index > array->count) {
+        fmp_table_t *tables = realloc(array->tables, table_index * sizeof(fmp_table_t));
+        if (!tables) {
+            ctx->error = FMP_ERROR_MALLOC;
+            return CHUNK_ABORT;
+        }
+        memset(&tables[array->count], 0, (table_index - array->count) * sizeof(fmp_table_t));
+        array->tables = tables;
+        array->count = table_index;
+    }
+    fmp_table_t *table = &array->tables[table_index-1];
+    convert(ctx->file->converter,
+            table->utf8_name, sizeof(table->utf8_name),
+            unmask_data(ctx->file, name), name->len);
+    table->index = table_index;
+    return CHUNK_NEXT;
+}
+
+static chunk_status_t handle_chunk_schema_v3(fmp_chunk_t *chunk, void *ctxp) {
+    fmp_schema_ctx_t *ctx = (fmp_schema_ctx_t *)ctxp;
+    if (chunk->path_values[0] > 3)
+        return stop_scan(ctx->file);
+
+    if (chunk->type != FMP_CHUNK_FIELD_REF_SIMPLE)
+        return CHUNK_NEXT;
+
+    if (table_path_match_start2(chunk, 3, 3, 5)) {
+        size_t column_index = chunk->path_values[chunk->path_level-1];
+        if (chunk->ref_simple == 1) {
+            return handle_column(ctx, 1, column_index, &chunk->data);
+        }
+        fmp_column_t *current_column = NULL;
+        if (column_index > 0 && ctx->schema->count &&
+                column_index <= ctx->schema->by_index[0].columns.count)
+            current_column = &ctx->schema->by_index[0].columns.columns[column_index-1];
+        if (current_column && chunk->ref_simple == 2) {
+            if (chunk->data.bytes[1] <= FMP_COLUMN_TYPE_GLOBAL) {
+                current_column->type = chunk->data.bytes[1];
+            } else {
+                current_column->type = FMP_COLUMN_TYPE_UNKNOWN;
+            }
+            current_column->collation = chunk->data.bytes[3];
+        }
+    }
+    return CHUNK_NEXT;
+}
+
+static chunk_status_t handle_chunk_schema_v7(fmp_chunk_t *chunk, void *ctxp) {
+    fmp_schema_ctx_t *ctx = (fmp_schema_ctx_t *)ctxp;
+    if (chunk->type != FMP_CHUNK_FIELD_REF_SIMPLE || chunk->ref_simple != 16)
+        return CHUNK_NEXT;
+
+    uint64_t last_value = chunk->path_values[chunk->path_level-1];
+    if (chunk->path_values[0] == 3 && chunk->path_values[1] == 16 &&
+            chunk->path_values[2] == 5 && chunk->path_values[3] >= 128 && last_value >= 128) {
+        return handle_table(ctx, last_value - 128, &chunk->data);
+    }
+    if (table_path_match_start2(chunk, 3, 3, 5)) {
+        return handle_column(ctx, chunk->path_values[0] - 128, last_value, &chunk->data);
+    }
+    return CHUNK_NEXT;
+}
+
+/* The catalog sorts ahead of every table's root, so a scan for the table
+ * list alone is over once the chain gets past [3] */
+static chunk_status_t handle_chunk_tables_v7(fmp_chunk_t *chunk, void *ctxp) {
+    fmp_schema_ctx_t *ctx = (fmp_schema_ctx_t *)ctxp;
+    if (chunk->path_values[0] > 3)
+        return stop_scan(ctx->file);
+    return handle_chunk_schema_v7(chunk, ctxp);
+}
+
+/* Drops the slots for numbers that were never named, and points each
+ * column's slot at where it ended up */
+fmp_error_t finish_table_schema(fmp_table_schema_t *table) {
+    fmp_column_array_t *array = &table->columns;
+    int j=0;
+    for (int i=0; i<array->count; i++) {
+        if (array->columns[i].index) {
+            if (i!=j) {
+                memmove(&array->columns[j], &array->columns[i], sizeof(fmp_column_t));
+            }
+            j++;
+        }
+    }
+    array->count = j;
+    table->slot_count = 0;
+    for (int i=0; i<array->count; i++) {
+        if (array->columns[i].index > table->slot_count)
+            table->slot_count = array->columns[i].index;
+    }
+    if (table->slot_count && !(table->slots = calloc(table->slot_count, sizeof(fmp_column_t *))))
+        return FMP_ERROR_MALLOC;
+    for (int i=0; i<array->count; i++)
+        table->slots[array->columns[i].index-1] = &array->columns[i];
+    return FMP_OK;
+}
+
+static void squash_tables(fmp_table_array_t *array) {
+    int j=0;
+    for (int i=0; i<array->count; i++) {
+        if (array->tables[i].index) {
+            if (i!=j) {
+                memmove(&array->tables[j], &array->tables[i], sizeof(fmp_table_t));
+            }
+            j++;
+        }
+    }
+    array->count = j;
+}
+
+static void name_single_table(fmp_file_t *file, fmp_table_array_t *array) {
+    array->count = 1;
+    array->tables[0].index = 1;
+    snprintf(array->tables[0].utf8_name, sizeof(array->tables[0].utf8_name),
+            "%s", file->filename);
+
+    // strip off extension
+    size_t len = strlen(array->tables[0].utf8_name);
+    for (int i=len-1; i>0; i--) {
+        if (array->tables[0].utf8_name[i] == '.') {
+            array->tables[0].utf8_name[i] = '\0';
+            break;
+        }
+    }
+}
+
+fmp_error_t load_schema(fmp_file_t *file) {
+    fmp_error_t retval = FMP_OK;
+    if (file->schema)
+        return FMP_OK;
+    fmp_schema_t *schema = calloc(1, sizeof(fmp_schema_t));
+    if (!schema)
+        return FMP_ERROR_MALLOC;
+    fmp_schema_ctx_t ctx = { .file = file, .schema = schema };
+    if (file->version_num >= 7) {
+        if (file->directory) {
+            retval = process_blocks(file, NULL, handle_chunk_schema_v7, &ctx);
+        } else {
+            retval = build_directory(file, handle_chunk_schema_v7, &ctx);
+        }
+        squash_tables(&schema->tables);
+    } else {
+        if (!(schema->tables.tables = calloc(1, sizeof(fmp_table_t)))) {
+            retval = FMP_ERROR_MALLOC;
+            goto cleanup;
+        }
+        name_single_table(file, &schema->tables);
+        uint64_t path[] = { 3 };
+        size_t first_id = seek_path(file, path, 1, 0);
+        size_t last_id = seek_path(file, path, 1, 1);
+        if (!first_id || !last_id)
+            first_id = last_id = 0;
+        retval = process_block_range(file, first_id ? first_id : 2, last_id,
+                NULL, handle_chunk_schema_v3, &ctx);
+    }
+    if (ctx.error)
+        retval = ctx.error;
+    for (size_t i=0; retval == FMP_OK && i<schema->count; i++)
+        retval = finish_table_schema(&schema->by_index[i]);
+
+cleanup:
+    if (retval != FMP_OK) {
+        free_schema(schema);
+        return retval;
+    }
+    file->schema = schema;
+    return FMP_OK;
+}
+
+/* Fills in the tables as load_schema lists them, without reading any
+ * columns, so that listing the tables touches only the leading blocks of
+ * the chain. Nothing is kept on the file handle. */
+fmp_error_t load_tables(fmp_file_t *file, fmp_table_array_t *array) {
+    fmp_error_t retval = FMP_OK;
+    fmp_schema_t schema = { 0 };
+    fmp_schema_ctx_t ctx = { .file = file, .schema = &schema };
+    if (file->version_num >= 7) {
+        retval = process_blocks(file, NULL, handle_chunk_tables_v7, &ctx);
+        if (ctx.error)
+            retval = ctx.error;
+        squash_tables(&schema.tables);
+    } else if ((schema.tables.tables = calloc(1, sizeof(fmp_table_t)))) {
+        name_single_table(file, &schema.tables);
+    } else {
+        retval = FMP_ERROR_MALLOC;
+    }
+    free(schema.by_index);
+    if (retval != FMP_OK) {
+        free(schema.tables.tables);
+        return retval;
+    }
+    *array = schema.tables;
+    return FMP_OK;
+}
+
+/* The columns of the table with the given index, or NULL if it has none */
+fmp_table_schema_t *table_schema(fmp_file_t *file, size_t table_index) {
+    fmp_schema_t *schema = file->schema;
+    if (!schema || table_index == 0 || table_index > schema->count)
+        return NULL;
+    return &schema->by_index[table_index-1];
+}
+
+void free_schema(fmp_schema_t *schema) {
+    if (schema) {
+        for (size_t i=0; i<schema->count; i++) {
+            free(schema->by_index[i].columns.columns);
+            free(schema->by_index[i].slots);
+            free(schema->by_index[i].marks);
+        }
+        free(schema->by_index);
+        free(schema->tables.tables);
+        free(schema);
+    }
+}
@@ -0,0 +1,245 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 600 /* pwrite, mkstemp */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* Sectors from a pipe arrive in file order, but are visited in chain order.
+ * stream_get_block() reads forward until the wanted sector has arrived,
+ * keeping everything it passes in memory since the chain will come back
+ * for it. With a memory limit, the oldest arrivals beyond the limit are
+ * written to an unlinked temporary file at their natural offsets and read
+ * back through a small sector cache when needed.
+ *
+ * Compressed input is decoded on the way in; see decompress.c. If the
+ * decoder can seek, evicted sectors are simply dropped and decoded again
+ * from the nearest checkpoint, so nothing is written to disk. */
+
+#define SPILL_CACHE_BLOCKS 16
+
+typedef enum {
+    SECTOR_IN_MEMORY,
+    SECTOR_SPILLED,
+    SECTOR_DROPPED
+} fmp_sector_state_t;
+
+struct fmp_stream_source_s {
+    FILE *stream;
+    fmp_decoder_t *decoder;
+    uint8_t magic[4];
+    size_t magic_len;
+    size_t magic_pos;
+    size_t arrived;
+    size_t memory_limit;
+    size_t in_memory;
+    size_t fifo_head;
+    uint32_t *fifo;
+    uint8_t *state;
+    int spill_fd;
+};
+
+fmp_stream_source_t *new_stream_source(FILE *stream, fmp_error_t *errorCode) {
+    fmp_stream_source_t *source = calloc(1, sizeof(fmp_stream_source_t));
+    if (!source) {
+        if (errorCode)
+            *errorCode = FMP_ERROR_MALLOC;
+        return NULL;
+    }
+    source->stream = stream;
+    source->spill_fd = -1;
+    source->magic_len = fread(source->magic, 1, sizeof(source->magic), stream);
+    if (is_compressed(source->magic, source->magic_len)) {
+        source->decoder = new_decoder(stream, source->magic, source->magic_len, errorCode);
+        if (!source->decoder) {
+            free(source);
+            return NULL;
+        }
+    }
+    return source;
+}
+
+/* Called once the index sector has been read and the claimed sector count is known */
+fmp_error_t stream_source_start(fmp_file_t *file, size_t memory_limit) {
+    fmp_stream_source_t *source = file->stream_source;
+    source->arrived = 1;
+    source->memory_limit = memory_limit;
+    if (memory_limit) {
+        source->fifo = malloc((memory_limit + 1) * sizeof(uint32_t));
+        source->state = calloc(file->blocks_allocated, 1);
+        if (!source->fifo || !source->state)
+            return FMP_ERROR_MALLOC;
+    }
+    return FMP_OK;
+}
+
+/* The spill file descriptor belongs to the cache once it exists */
+void free_stream_source(fmp_stream_source_t *source) {
+    if (source->decoder)
+        free_decoder(source->decoder);
+    free(source->fifo);
+    free(source->state);
+    free(source);
+}
+
+fmp_error_t stream_read(fmp_stream_source_t *source, void *buf, size_t len) {
+    uint8_t *dst = buf;
+    if (source->decoder)
+        return decoder_read(source->decoder, dst, len) == len ? FMP_OK : FMP_ERROR_READ;
+    while (len && source->magic_pos < source->magic_len) {
+        *dst++ = source->magic[source->magic_pos++];
+        len--;
+    }
+    if (len && !fread(dst, len, 1, source->stream))
+        return FMP_ERROR_READ;
+    return FMP_OK;
+}
+
+static int open_spill_file(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/fmptools-XXXXXX", dir && dir[0] ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd != -1)
+        unlink(path);
+    return fd;
+}
+
+static int pwrite_fully(int fd, const uint8_t *buf, size_t len, size_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t count = pwrite(fd, &buf[done], len - done, offset + done);
+        if (count <= 0)
+            return 0;
+        done += count;
+    }
+    return 1;
+}
+
+static fmp_error_t evict_oldest(fmp_file_t *file, fmp_stream_source_t *source) {
+    size_t capacity = source->memory_limit + 1;
+    size_t index = source->fifo[source->fifo_head];
+    fmp_block_t *block = file->blocks[index];
+    if (source->decoder && decoder_can_seek(source->decoder)) {
+        source->state[index] = SECTOR_DROPPED;
+    } else {
+        if (source->spill_fd == -1) {
+            if ((source->spill_fd = open_spill_file()) == -1)
+                return FMP_ERROR_OPEN;
+            file->cache = new_cache(source->spill_fd, SPILL_CACHE_BLOCKS, file->sector_size, 0);
+            if (!file->cache) {
+                close(source->spill_fd);
+                source->spill_fd = -1;
+                return FMP_ERROR_MALLOC;
+            }
+        }
+        if (!pwrite_fully(source->spill_fd, (uint8_t *)&block[1], file->sector_size, sector_offset(file, index)))
+            return FMP_ERROR_READ;
+        source->state[index] = SECTOR_SPILLED;
+    }
+    free(block);
+    file->blocks[index] = NULL;
+    source->fifo_head = (source->fifo_head + 1) % capacity;
+    source->in_memory--;
+    return FMP_OK;
+}
+
+static fmp_error_t keep_sector(fmp_file_t *file, fmp_stream_source_t *source, size_t index) {
+    size_t capacity = source->memory_limit + 1;
+    source->state[index] = SECTOR_IN_MEMORY;
+    source->fifo[(source->fifo_head + source->in_memory) % capacity] = index;
+    source->in_memory++;
+    if (source->in_memory > source->memory_limit)
+        return evict_oldest(file, source);
+    return FMP_OK;
+}
+
+/* The sector count in the header is only a claim, so blocks[] and the state
+ * map are doubled as sectors arrive rather than sized from it up front */
+static fmp_error_t make_room(fmp_file_t *file, fmp_stream_source_t *source, size_t index) {
+    size_t old_len = file->blocks_allocated;
+    if (index < old_len)
+        return FMP_OK;
+    size_t new_len = 2 * old_len > index ? 2 * old_len : index + 1;
+    if (new_len > file->num_blocks)
+        new_len = file->num_blocks;
+    if (source->state) {
+        uint8_t *state = realloc(source->state, new_len);
+        if (!state)
+            return FMP_ERROR_MALLOC;
+        memset(&state[old_len], 0, new_len - old_len);
+        source->state = state;
+    }
+    return grow_blocks(file, new_len);
+}
+
+static fmp_error_t load_sector(fmp_file_t *file, fmp_stream_source_t *source, size_t index) {
+    fmp_error_t retval = make_room(file, source, index);
+    if (retval != FMP_OK)
+        return retval;
+    fmp_block_t *block = calloc(1, sizeof(fmp_block_t) + file->sector_size);
+    if (!block)
+        return FMP_ERROR_MALLOC;
+    uint8_t *sector = (uint8_t *)&block[1];
+    if (index < source->arrived) {
+        retval = decoder_pread(source->decoder, sector, file->sector_size, sector_offset(file, index));
+    } else if (stream_read(source, sector, file->sector_size) != FMP_OK) {
+        retval = FMP_ERROR_INCOMPLETE_SECTOR;
+    } else {
+        source->arrived++;
+    }
+    if (retval == FMP_OK)
+        retval = init_block_in_sector(file, block, sector);
+    if (retval != FMP_OK) {
+        free(block);
+        return retval;
+    }
+    block->this_id = index + 1;
+    file->blocks[index] = block;
+    if (source->memory_limit)
+        retval = keep_sector(file, source, index);
+    return retval;
+}
+
+fmp_block_t *stream_get_block(fmp_file_t *file, size_t index, fmp_error_t *errorCode) {
+    fmp_stream_source_t *source = file->stream_source;
+    fmp_error_t retval = FMP_OK;
+    while (index >= source->arrived && retval == FMP_OK)
+        retval = load_sector(file, source, source->arrived);
+    if (retval == FMP_OK && source->state) {
+        if (source->state[index] == SECTOR_SPILLED)
+            return cache_get_block(file, index, errorCode);
+        if (source->state[index] == SECTOR_DROPPED)
+            retval = load_sector(file, source, index);
+    }
+    if (retval != FMP_OK) {
+        if (errorCode)
+            *errorCode = retval;
+        return NULL;
+    }
+    return file->blocks[index];
+}
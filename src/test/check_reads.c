@@ -0,0 +1,413 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Checks that the readers which reach only part of a table hand over the
+ * same values fmp_read_values does, for every table of every file under
+ * test/data: fmp_read_rows over a few pages, fmp_get_record over every
+ * record, fmp_read_values_where with a filter built from a stored value,
+ * and fmp_read_values again on a copy of the file with a sidecar index.
+ *
+ *     make check, or ./check_reads [file ...]
+ */
+
+#define _XOPEN_SOURCE 700 /* mkdtemp */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "../fmp.h"
+
+#define MAX_RECORD_MISSES 200000
+
+typedef struct value_s {
+    int row;
+    int column;
+    char *value;
+} value_t;
+
+typedef struct value_list_s {
+    value_t *values;
+    size_t count;
+    size_t capacity;
+} value_list_t;
+
+static fmp_handler_status_t collect_value(int row, fmp_column_t *column, const char *value, void *ctx) {
+    value_list_t *list = (value_list_t *)ctx;
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? 2 * list->capacity : 256;
+        value_t *values = realloc(list->values, capacity * sizeof(value_t));
+        if (!values)
+            return FMP_HANDLER_ABORT;
+        list->values = values;
+        list->capacity = capacity;
+    }
+    char *copy = strdup(value);
+    if (!copy)
+        return FMP_HANDLER_ABORT;
+    list->values[list->count++] = (value_t){ .row = row, .column = column->index, .value = copy };
+    return FMP_HANDLER_OK;
+}
+
+static void free_values(value_list_t *list) {
+    for (size_t i=0; i<list->count; i++)
+        free(list->values[i].value);
+    free(list->values);
+    memset(list, 0, sizeof(value_list_t));
+}
+
+static int compare_values(const void *a, const void *b) {
+    const value_t *value_a = a, *value_b = b;
+    if (value_a->row != value_b->row)
+        return value_a->row < value_b->row ? -1 : 1;
+    if (value_a->column != value_b->column)
+        return value_a->column < value_b->column ? -1 : 1;
+    return strcmp(value_a->value, value_b->value);
+}
+
+/* Whether got holds, in order, just the values in all whose rows are wanted */
+static int same_values(value_list_t *all, int (*wanted)(int row, void *ctx), void *ctx,
+        value_list_t *got) {
+    size_t j = 0;
+    for (size_t i=0; i<all->count; i++) {
+        value_t *value = &all->values[i];
+        if (!wanted(value->row, ctx))
+            continue;
+        if (j == got->count || compare_values(value, &got->values[j]) != 0)
+            return 0;
+        j++;
+    }
+    return j == got->count;
+}
+
+static int any_row(int row, void *ctx) {
+    return 1;
+}
+
+typedef struct row_range_s {
+    size_t first;
+    size_t count;
+} row_range_t;
+
+static int row_in_range(int row, void *ctx) {
+    row_range_t *range = (row_range_t *)ctx;
+    return (size_t)row >= range->first && (size_t)row - range->first < range->count;
+}
+
+static int row_marked(int row, void *ctx) {
+    return ((const unsigned char *)ctx)[row];
+}
+
+static int report(const char *path, fmp_table_t *table, const char *what, fmp_error_t error) {
+    fprintf(stderr, "%s: table %s: %s disagrees with fmp_read_values (error %d)\n",
+            path, table->utf8_name, what, error);
+    return 1;
+}
+
+static int check_read_rows(const char *path, fmp_file_t *file, fmp_table_t *table,
+        value_list_t *all, size_t rows) {
+    row_range_t ranges[] = { { 1, rows }, { 2, 3 }, { rows / 2, 50 }, { rows, 1 }, { rows + 1, 10 } };
+    int failures = 0;
+    for (size_t i=0; i<sizeof(ranges)/sizeof(ranges[0]); i++) {
+        value_list_t got = { 0 };
+        if (!ranges[i].first)
+            continue;
+        fmp_error_t error = fmp_read_rows(file, table, ranges[i].first, ranges[i].count, collect_value, &got);
+        if (error != FMP_OK || !same_values(all, row_in_range, &ranges[i], &got))
+            failures += report(path, table, "fmp_read_rows", error);
+        free_values(&got);
+    }
+    return failures;
+}
+
+/* Record ids aren't handed to value handlers, so every id is tried until
+ * each value has turned up. Records needn't come back in row order. */
+static int check_get_record(const char *path, fmp_file_t *file, fmp_table_t *table,
+        value_list_t *all) {
+    value_list_t got = { 0 }, sorted = { 0 };
+    fmp_error_t error = FMP_OK;
+    size_t misses = 0;
+    for (size_t record_id=1; got.count < all->count && misses < MAX_RECORD_MISSES; record_id++) {
+        error = fmp_get_record(file, table, record_id, collect_value, &got);
+        if (error == FMP_ERROR_NO_SUCH_RECORD) {
+            misses++;
+        } else if (error != FMP_OK) {
+            break;
+        }
+    }
+    if (error == FMP_ERROR_NO_SUCH_RECORD)
+        error = FMP_OK;
+    sorted = *all;
+    sorted.values = malloc(all->count * sizeof(value_t) + 1);
+    if (sorted.values && all->count)
+        memcpy(sorted.values, all->values, all->count * sizeof(value_t));
+    if (sorted.values && sorted.count)
+        qsort(sorted.values, sorted.count, sizeof(value_t), compare_values);
+    if (got.count)
+        qsort(got.values, got.count, sizeof(value_t), compare_values);
+    int failures = 0;
+    if (!sorted.values || error != FMP_OK || !same_values(&sorted, any_row, NULL, &got))
+        failures = report(path, table, "fmp_get_record", error);
+    free(sorted.values);
+    free_values(&got);
+    return failures;
+}
+
+/* Values that are printable ASCII, apart from line breaks, are stored as
+ * they're handed over, so they can be used as filter operands */
+static int usable_operand(const char *value) {
+    if (!value[0] || value[0] == ' ')
+        return 0;
+    for (const char *p=value; *p; p++) {
+        if ((*p < 0x20 || *p > 0x7E) && *p != '\n')
+            return 0;
+    }
+    return 1;
+}
+
+static int check_read_where(const char *path, fmp_file_t *file, fmp_table_t *table,
+        value_list_t *all) {
+    value_t *operand = NULL;
+    int max_row = 0;
+    for (size_t i=0; i<all->count; i++) {
+        if (!operand && usable_operand(all->values[i].value))
+            operand = &all->values[i];
+        if (all->values[i].row > max_row)
+            max_row = all->values[i].row;
+    }
+    if (!operand)
+        return 0;
+
+    fmp_error_t error = FMP_OK;
+    fmp_column_array_t *columns = fmp_list_columns(file, table, &error);
+    fmp_column_t *column = NULL;
+    for (size_t i=0; columns && i<columns->count; i++) {
+        if (columns->columns[i].index == operand->column)
+            column = &columns->columns[i];
+    }
+    if (!column) {
+        fmp_free_columns(columns);
+        return report(path, table, "fmp_list_columns", error);
+    }
+
+    int failures = 0;
+    size_t prefix_len = strlen(operand->value) > 3 ? 3 : strlen(operand->value);
+    for (int prefix=0; prefix<2; prefix++) {
+        unsigned char *wanted = calloc(max_row + 1, 1);
+        fmp_filter_t *filter = fmp_new_filter(&error);
+        value_list_t got = { 0 };
+        if (!wanted || !filter) {
+            failures += report(path, table, "fmp_new_filter", error);
+        } else {
+            for (size_t i=0; i<all->count; i++) {
+                value_t *value = &all->values[i];
+                if (value->column == operand->column && (prefix ?
+                            strncmp(value->value, operand->value, prefix_len) == 0 :
+                            strcmp(value->value, operand->value) == 0))
+                    wanted[value->row] = 1;
+            }
+            if (prefix)
+                error = fmp_filter_prefix(filter, column, operand->value, prefix_len);
+            else
+                error = fmp_filter_equals(filter, column, operand->value, strlen(operand->value));
+            if (error == FMP_OK)
+                error = fmp_read_values_where(file, table, NULL, filter, collect_value, &got);
+            if (error != FMP_OK || !same_values(all, row_marked, wanted, &got))
+                failures += report(path, table, "fmp_read_values_where", error);
+        }
+        free_values(&got);
+        fmp_free_filter(filter);
+        free(wanted);
+    }
+    fmp_free_columns(columns);
+    return failures;
+}
+
+static int copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = in ? fopen(to, "wb") : NULL;
+    char buf[65536];
+    size_t len = 0;
+    int ok = (out != NULL);
+    while (ok && (len = fread(buf, 1, sizeof(buf), in)) > 0)
+        ok = (fwrite(buf, 1, len, out) == len);
+    if (in)
+        fclose(in);
+    if (out && fclose(out) != 0)
+        ok = 0;
+    return ok;
+}
+
+/* The index is built on a copy so the test data is left as it is */
+static int check_index(const char *path, fmp_table_array_t *tables, value_list_t *all) {
+    const char *tmpdir = getenv("TMPDIR");
+    char dir[1024], copy[1200], index[1300];
+    snprintf(dir, sizeof(dir), "%s/fmptools-check-XXXXXX", tmpdir && tmpdir[0] ? tmpdir : "/tmp");
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "%s: can't make a temporary directory\n", path);
+        return 1;
+    }
+    const char *name = strrchr(path, '/');
+    snprintf(copy, sizeof(copy), "%s/%s", dir, name ? name + 1 : path);
+    snprintf(index, sizeof(index), "%s.fmpidx", copy);
+
+    int failures = 0;
+    fmp_error_t error = FMP_OK;
+    fmp_file_t *file = NULL;
+    fmp_table_array_t *indexed_tables = NULL;
+    if (!copy_file(path, copy) || (error = fmp_build_index(copy)) != FMP_OK) {
+        fprintf(stderr, "%s: can't build a sidecar index (error %d)\n", path, error);
+        failures++;
+    } else if (!(file = fmp_open_file(copy, &error)) ||
+            !(indexed_tables = fmp_list_tables(file, &error)) ||
+            indexed_tables->count != tables->count) {
+        fprintf(stderr, "%s: tables differ with a sidecar index (error %d)\n", path, error);
+        failures++;
+    } else {
+        for (size_t i=0; i<tables->count; i++) {
+            value_list_t got = { 0 };
+            error = fmp_read_values(file, &indexed_tables->tables[i], collect_value, &got);
+            if (error != FMP_OK || !same_values(&all[i], any_row, NULL, &got))
+                failures += report(path, &tables->tables[i], "the sidecar index", error);
+            free_values(&got);
+        }
+    }
+    if (indexed_tables)
+        fmp_free_tables(indexed_tables);
+    if (file)
+        fmp_close_file(file);
+    unlink(index);
+    unlink(copy);
+    rmdir(dir);
+    return failures;
+}
+
+static int check_file(const char *path) {
+    fmp_open_options_t options = { .skip_index = 1 };
+    fmp_error_t error = FMP_OK;
+    fmp_file_t *file = fmp_open_file_with_options(path, &options, &error);
+    if (!file) {
+        /* Some of the test data is deliberately left unreadable */
+        printf("skipped %s: can't open (error %d)\n", path, error);
+        return 0;
+    }
+    fmp_table_array_t *tables = fmp_list_tables(file, &error);
+    if (!tables) {
+        fprintf(stderr, "%s: can't list tables (error %d)\n", path, error);
+        fmp_close_file(file);
+        return 1;
+    }
+    value_list_t *all = calloc(tables->count + 1, sizeof(value_list_t));
+    int failures = 0;
+    for (size_t i=0; all && i<tables->count; i++) {
+        fmp_table_t *table = &tables->tables[i];
+        size_t rows = 0;
+        if ((error = fmp_read_values(file, table, collect_value, &all[i])) != FMP_OK ||
+                (error = fmp_count_rows(file, table, &rows)) != FMP_OK) {
+            failures += report(path, table, "fmp_read_values", error);
+            continue;
+        }
+        failures += check_read_rows(path, file, table, &all[i], rows);
+        failures += check_read_where(path, file, table, &all[i]);
+        failures += check_get_record(path, file, table, &all[i]);
+    }
+    if (!all)
+        failures++;
+    else
+        failures += check_index(path, tables, all);
+    for (size_t i=0; all && i<tables->count; i++)
+        free_values(&all[i]);
+    free(all);
+    printf("%s %s: %zu tables\n", failures ? "FAIL" : "ok", path, tables->count);
+    fmp_free_tables(tables);
+    fmp_close_file(file);
+    return failures;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int is_database(const char *name) {
+    const char *extension = strrchr(name, '.');
+    const char *extensions[] = { ".fp3", ".fp5", ".fp7", ".fmp12" };
+    for (size_t i=0; extension && i<sizeof(extensions)/sizeof(extensions[0]); i++) {
+        if (strcasecmp(extension, extensions[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Every database in srcdir/test/data/subdir, in name order */
+static int check_directory(const char *srcdir, const char *subdir, int *checked) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/test/data/%s", srcdir, subdir);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    char **names = NULL;
+    size_t count = 0;
+    struct dirent *entry = NULL;
+    while ((entry = readdir(dir))) {
+        if (!is_database(entry->d_name))
+            continue;
+        char **more = realloc(names, (count + 1) * sizeof(char *));
+        if (!more)
+            break;
+        names = more;
+        if ((names[count] = strdup(entry->d_name)))
+            count++;
+    }
+    closedir(dir);
+    if (count)
+        qsort(names, count, sizeof(char *), compare_names);
+    int failures = 0;
+    for (size_t i=0; i<count; i++) {
+        char file_path[2048];
+        snprintf(file_path, sizeof(file_path), "%s/%s", path, names[i]);
+        failures += check_file(file_path);
+        (*checked)++;
+        free(names[i]);
+    }
+    free(names);
+    return failures;
+}
+
+int main(int argc, char *argv[]) {
+    const char *subdirs[] = { "fp3", "fp5", "fp7", "fmp12" };
+    const char *srcdir = getenv("srcdir");
+    int failures = 0, checked = 0;
+    if (argc > 1) {
+        for (int i=1; i<argc; i++)
+            failures += check_file(argv[i]);
+        return failures ? 1 : 0;
+    }
+    for (size_t i=0; i<sizeof(subdirs)/sizeof(subdirs[0]); i++)
+        failures += check_directory(srcdir ? srcdir : ".", subdirs[i], &checked);
+    if (!checked) {
+        fprintf(stderr, "No test data found under %s/test/data\n", srcdir ? srcdir : ".");
+        return 77;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+/* FMP Tools - A library for reading FileMaker Pro databases
+ * Copyright (c) 2020 Evan Miller (except where otherwise noted)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "fmp.h"
+#include "fmp_internal.h"
+
+/* fp7 and fmp12 files XOR their string data with a constant mask. The first
+ * time a handler asks for a value from a block, unmask_data() unmasks that
+ * block's whole payload in one pass, so it's worth doing a vector at a time;
+ * the loads and stores are unaligned because payloads start at an odd
+ * offset into the sector. */
+void unmask_bytes(uint8_t *dst, const uint8_t *src, size_t len, uint8_t mask) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i vmask32 = _mm256_set1_epi8((char)mask);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+        _mm256_storeu_si256((__m256i *)&dst[i], _mm256_xor_si256(v, vmask32));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i vmask = _mm_set1_epi8((char)mask);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(v, vmask));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t vmask = vdupq_n_u8(mask);
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&src[i]), vmask));
+    }
+#endif
+    for (; i < len; i++) {
+        dst[i] = src[i] ^ mask;
+    }
+}